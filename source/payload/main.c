@@ -15,6 +15,15 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
 // #include <sys/statvfs.h>  // REMOVED - No longer needed
 #include <sys/mount.h>
 #include <fcntl.h>
@@ -26,44 +35,530 @@
 #include <signal.h>
 #include <poll.h>
 #include <stdbool.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
 
 #define SERVER_PORT 9113
 #define BUFFER_SIZE (8 * 1024 * 1024)  // 8MB for maximum throughput
 #define MAX_PATH 2048
 #define DISK_WORKER_COUNT 4
 #define QUEUE_MAX_SIZE 32
+#define UPLOAD_PIPELINE_DEPTH 2  // recv into buffer N+1 while buffer N is written
+#define IO_THREAD_COUNT 2        // Threads waiting on socket readiness
+#define CONN_WORKER_MAX 64       // Threads running commands, started on demand
+#define OUTPUT_BUFFER_SIZE (16 * 1024)  // Per-session response buffer
+#ifndef POOL_BUDGET_BYTES
+#define POOL_BUDGET_BYTES (128 * 1024 * 1024)  // Total preallocated I/O buffer memory (override with -D)
+#endif
+#ifndef ADMIT_MAX_FILES
+#define ADMIT_MAX_FILES 4  // Large files uploading at once, more wait in line (override with -D)
+#endif
+#ifndef ADMIT_BUFFER_BUDGET
+#define ADMIT_BUFFER_BUDGET POOL_BUDGET_BYTES  // Receive buffers large uploads may claim (override with -D)
+#endif
+#ifndef ADMIT_MAX_QUEUE
+#define ADMIT_MAX_QUEUE 256  // Large uploads waiting in line, more are turned away (override with -D)
+#endif
 
-// Per-file mutex hash map to prevent corruption during parallel uploads to SAME file
-// Different files can write in parallel without blocking each other
-typedef struct file_mutex_entry {
+// ============================================================================
+// CHECKSUMS
+// ============================================================================
+// CRC32C is computed inline while upload bytes pass through, using the SSE4.2
+// crc32 instruction when the CPU has it (the PS5's Zen 2 does) and a
+// slice-by-8 table otherwise. Ranges hashed by different stripes are joined
+// with crc32c_combine(). SHA-256 is optional and only for sequential uploads.
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t g_crc32c_table[8][256];
+static bool g_crc32c_hw = false;
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        g_crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = g_crc32c_table[t - 1][i];
+            g_crc32c_table[t][i] = (prev >> 8) ^ g_crc32c_table[0][prev & 0xFF];
+        }
+    }
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        g_crc32c_hw = (ecx & bit_SSE4_2) != 0;
+    }
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = g_crc32c_table[7][lo & 0xFF] ^ g_crc32c_table[6][(lo >> 8) & 0xFF] ^
+              g_crc32c_table[5][(lo >> 16) & 0xFF] ^ g_crc32c_table[4][lo >> 24] ^
+              g_crc32c_table[3][hi & 0xFF] ^ g_crc32c_table[2][(hi >> 8) & 0xFF] ^
+              g_crc32c_table[1][(hi >> 16) & 0xFF] ^ g_crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ g_crc32c_table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) {
+        c32 = _mm_crc32_u8(c32, *p++);
+    }
+    return c32;
+}
+#endif
+
+// Running CRC32C, zlib-style: start with 0, feed the previous result back in
+uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (g_crc32c_hw) {
+        return ~crc32c_hw(crc, data, len);
+    }
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// CRC of A followed by B, from crc(A), crc(B) and len(B) - no data needed
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    if (len2 == 0) return crc1;
+    
+    uint32_t even[32], odd[32];
+    odd[0] = CRC32C_POLY;  // Operator for one zero bit
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);  // Two zero bits
+    gf2_matrix_square(odd, even);  // Four zero bits
+    
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2 != 0);
+    
+    return crc1 ^ crc2;
+}
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t total;
+    uint8_t block[64];
+    size_t block_len;
+} sha256_ctx_t;
+
+static const uint32_t k_sha256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_ctx_t *ctx, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+               ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + k_sha256[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->total = 0;
+    ctx->block_len = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const uint8_t *data, size_t len) {
+    ctx->total += len;
+    if (ctx->block_len > 0) {
+        size_t take = 64 - ctx->block_len;
+        if (take > len) take = len;
+        memcpy(ctx->block + ctx->block_len, data, take);
+        ctx->block_len += take;
+        data += take;
+        len -= take;
+        if (ctx->block_len < 64) return;
+        sha256_block(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+    while (len >= 64) {
+        sha256_block(ctx, data);
+        data += 64;
+        len -= 64;
+    }
+    memcpy(ctx->block, data, len);
+    ctx->block_len = len;
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t out[32]) {
+    uint64_t bits = ctx->total * 8;
+    uint8_t pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    uint8_t zero = 0;
+    while (ctx->block_len != 56) {
+        sha256_update(ctx, &zero, 1);
+    }
+    uint8_t len_be[8];
+    for (int i = 0; i < 8; i++) {
+        len_be[i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, len_be, 8);
+    for (int i = 0; i < 8; i++) {
+        out[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        out[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+// ============================================================================
+// COMPRESSION
+// ============================================================================
+// LZ4 block format (compatible with LZ4_compress_default/LZ4_decompress_safe),
+// used for chunk payloads once a connection negotiated it with HELLO. Blocks
+// that would not shrink are sent raw.
+
+#define LZ4_HASH_LOG 16
+#define LZ4_MIN_MATCH 4
+#define LZ4_MF_LIMIT 12     // A match must start at least this far from the end
+#define LZ4_LAST_LITERALS 5 // ... and end at least this far from it
+#define LZ4_MAX_OFFSET 65535
+
+#define CODEC_RAW 0
+#define CODEC_LZ4 1
+
+// Worst-case compressed size of an incompressible block
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit literals [anchor, anchor + lit) followed by a match (none if match_len == 0)
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *anchor, size_t lit,
+                                 size_t offset, size_t match_len) {
+    if ((size_t)(oend - op) < lit + lit / 255 + match_len / 255 + 8) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        op = lz4_put_len(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    if (match_len == 0) {
+        return op;
+    }
+    
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) {
+        op = lz4_put_len(op, ml - 15);
+    }
+    return op;
+}
+
+// Compress src into dst. table must hold 1 << LZ4_HASH_LOG entries.
+// Returns the compressed size, or 0 if it would not fit in dst_cap.
+size_t lz4_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap, uint32_t *table) {
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + src_len;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + dst_cap;
+    
+    if (src_len > LZ4_MF_LIMIT) {
+        const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+        unsigned misses = 0;
+        
+        while (ip < mf_limit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                // Skip faster through data that does not match
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + LZ4_MIN_MATCH;
+            const uint8_t *r = ref + LZ4_MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+            
+            op = lz4_put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip));
+            if (!op) return 0;
+            ip = m;
+            anchor = ip;
+        }
+    }
+    
+    op = lz4_put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Decompress a block that must expand to exactly dst_len bytes. Returns 0 on success.
+int lz4_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_len;
+    
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;  // Last sequence carries literals only
+        
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return -1;
+        
+        const uint8_t *m = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, m, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; i++) {
+                op[i] = m[i];  // Overlapping copy repeats the pattern
+            }
+        }
+        op += match_len;
+    }
+    return op == oend ? 0 : -1;
+}
+
+// Effective compression, reported by STATS
+typedef struct {
+    uint64_t raw;   // Bytes before compression / after decompression
+    uint64_t wire;  // Bytes actually sent or received
+} codec_counter_t;
+
+static codec_counter_t g_codec_upload = {0};
+static codec_counter_t g_codec_download = {0};
+static pthread_mutex_t g_codec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void codec_count(codec_counter_t *counter, uint64_t raw, uint64_t wire) {
+    pthread_mutex_lock(&g_codec_lock);
+    counter->raw += raw;
+    counter->wire += wire;
+    pthread_mutex_unlock(&g_codec_lock);
+}
+
+size_t codec_format_stats(char *out, size_t out_size) {
+    pthread_mutex_lock(&g_codec_lock);
+    codec_counter_t up = g_codec_upload;
+    codec_counter_t down = g_codec_download;
+    pthread_mutex_unlock(&g_codec_lock);
+    
+    int len = snprintf(out, out_size,
+                       "lz4_upload_raw=%llu\nlz4_upload_wire=%llu\nlz4_upload_ratio=%.2f\n"
+                       "lz4_download_raw=%llu\nlz4_download_wire=%llu\nlz4_download_ratio=%.2f\n",
+                       (unsigned long long)up.raw, (unsigned long long)up.wire,
+                       up.wire ? (double)up.raw / up.wire : 1.0,
+                       (unsigned long long)down.raw, (unsigned long long)down.wire,
+                       down.wire ? (double)down.raw / down.wire : 1.0);
+    if (len < 0) return 0;
+    return (size_t)len < out_size ? (size_t)len : out_size - 1;
+}
+
+// Per-file state shared by every connection uploading the SAME file.
+// The mutex guards creation/pre-allocation and the received-range map;
+// different files never contend.
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+} byte_range_t;
+
+// CRC32C of one contiguous range of the file
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+    uint32_t crc;
+} digest_range_t;
+
+// Queued disk writes of one file. The disk queue serves files in deficit
+// round-robin, so every upload gets a fair share of the disk whatever its
+// chunk size or stripe count.
+typedef struct sched_flow {
+    struct write_job *head;
+    struct write_job *tail;
+    int queued;
+    int64_t deficit;           // Bytes this flow may still write in its turn
+    bool active;               // Linked into the queue's round
+    struct sched_flow *next;
+} sched_flow_t;
+
+typedef struct file_state {
     char path[MAX_PATH];
+    sched_flow_t flow;         // Guarded by the disk queue mutex
     pthread_mutex_t mutex;
     int ref_count;
-    struct file_mutex_entry *next;
-} file_mutex_entry_t;
+    // Byte ranges already written, sorted and merged
+    byte_range_t *ranges;
+    int range_count;
+    int range_cap;
+    uint64_t file_size;
+    bool journaled;            // Ranges are persisted to a sidecar resume journal
+    bool journal_saving;
+    uint64_t unsaved_bytes;    // Recorded since the last journal save
+    // Per-range CRC32C reported by the uploading connections, merged when adjacent
+    digest_range_t *digests;
+    int digest_count;
+    int digest_cap;
+    bool digests_broken;       // Overlapping ranges were hashed - no whole-file CRC
+    bool renamed;              // Delta result already moved over the original
+    struct file_state *next;
+} file_state_t;
 
-static file_mutex_entry_t *g_file_mutexes = NULL;
-static pthread_mutex_t g_mutex_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_state_t *g_file_states = NULL;
+static pthread_mutex_t g_file_state_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// Get or create mutex for a specific file path
-pthread_mutex_t* get_file_mutex(const char *path) {
-    pthread_mutex_lock(&g_mutex_map_lock);
+// Get or create the state for a specific file path
+file_state_t* get_file_state(const char *path) {
+    pthread_mutex_lock(&g_file_state_lock);
     
-    // Search for existing mutex
-    file_mutex_entry_t *entry = g_file_mutexes;
+    // Search for existing state
+    file_state_t *entry = g_file_states;
     while (entry) {
         if (strcmp(entry->path, path) == 0) {
             entry->ref_count++;
-            pthread_mutex_unlock(&g_mutex_map_lock);
-            return &entry->mutex;
+            pthread_mutex_unlock(&g_file_state_lock);
+            return entry;
         }
         entry = entry->next;
     }
     
-    // Create new mutex for this file
-    entry = (file_mutex_entry_t*)malloc(sizeof(file_mutex_entry_t));
+    // Create new state for this file
+    entry = (file_state_t*)calloc(1, sizeof(file_state_t));
     if (!entry) {
-        pthread_mutex_unlock(&g_mutex_map_lock);
+        pthread_mutex_unlock(&g_file_state_lock);
         return NULL;
     }
     
@@ -71,25 +566,42 @@ pthread_mutex_t* get_file_mutex(const char *path) {
     entry->path[sizeof(entry->path) - 1] = '\0';
     pthread_mutex_init(&entry->mutex, NULL);
     entry->ref_count = 1;
-    entry->next = g_file_mutexes;
-    g_file_mutexes = entry;
+    entry->next = g_file_states;
+    g_file_states = entry;
     
-    pthread_mutex_unlock(&g_mutex_map_lock);
-    return &entry->mutex;
+    pthread_mutex_unlock(&g_file_state_lock);
+    return entry;
+}
+
+// Existing state for a path (reference taken), NULL if no upload has it open
+file_state_t* find_file_state(const char *path) {
+    pthread_mutex_lock(&g_file_state_lock);
+    file_state_t *entry = g_file_states;
+    while (entry && strcmp(entry->path, path) != 0) {
+        entry = entry->next;
+    }
+    if (entry) {
+        entry->ref_count++;
+    }
+    pthread_mutex_unlock(&g_file_state_lock);
+    return entry;
 }
 
-// Release mutex reference
-void release_file_mutex(const char *path) {
-    pthread_mutex_lock(&g_mutex_map_lock);
+// Release state reference. Returns the references still held on the file.
+int release_file_state(const char *path) {
+    pthread_mutex_lock(&g_file_state_lock);
     
-    file_mutex_entry_t **ptr = &g_file_mutexes;
+    int remaining = 0;
+    file_state_t **ptr = &g_file_states;
     while (*ptr) {
         if (strcmp((*ptr)->path, path) == 0) {
-            (*ptr)->ref_count--;
-            if ((*ptr)->ref_count == 0) {
-                file_mutex_entry_t *to_free = *ptr;
+            remaining = --(*ptr)->ref_count;
+            if (remaining == 0) {
+                file_state_t *to_free = *ptr;
                 *ptr = (*ptr)->next;
                 pthread_mutex_destroy(&to_free->mutex);
+                free(to_free->ranges);
+                free(to_free->digests);
                 free(to_free);
             }
             break;
@@ -97,7 +609,414 @@ void release_file_mutex(const char *path) {
         ptr = &(*ptr)->next;
     }
     
-    pthread_mutex_unlock(&g_mutex_map_lock);
+    pthread_mutex_unlock(&g_file_state_lock);
+    return remaining;
+}
+
+// ============================================================================
+// RESUMABLE UPLOADS
+// ============================================================================
+// Received ranges of an upload are journaled next to the file in
+// "<path>.ps5part" so a reconnecting client can ask which ranges are still
+// missing and send only those. The journal is removed once every byte landed.
+
+#define RESUME_JOURNAL_SUFFIX ".ps5part"
+#define RESUME_MIN_SIZE (100ULL * 1024 * 1024)        // Larger uploads are always journaled
+#define RESUME_SAVE_INTERVAL (256ULL * 1024 * 1024)   // Journal save every N bytes written
+#define RESUME_JOURNAL_MAGIC 0x52355350               // "PS5R"
+
+#define UPLOAD_FLAG_RESUME 0x01  // START_UPLOAD: keep existing data, continue from the journal
+#define UPLOAD_FLAG_DIGEST 0x02  // START_UPLOAD: END_UPLOAD replies with the CRC32C digest
+#define UPLOAD_FLAG_SHA256 0x04  // START_UPLOAD: also SHA-256 (whole file from offset 0 only)
+#define UPLOAD_FLAG_DELTA 0x08   // START_UPLOAD: rebuild the file from its old copy + new blocks
+#define DELTA_TEMP_SUFFIX ".ps5delta"  // Delta uploads are assembled here, then renamed over
+
+// Merge [offset, offset + len) into the range map (caller holds fs->mutex)
+void ranges_add(file_state_t *fs, uint64_t offset, uint64_t len) {
+    if (len == 0) return;
+    uint64_t start = offset;
+    uint64_t end = offset + len;
+    
+    // First range that overlaps or touches the new one
+    int i = 0;
+    while (i < fs->range_count && fs->ranges[i].offset + fs->ranges[i].len < start) {
+        i++;
+    }
+    int j = i;
+    while (j < fs->range_count && fs->ranges[j].offset <= end) {
+        if (fs->ranges[j].offset < start) start = fs->ranges[j].offset;
+        if (fs->ranges[j].offset + fs->ranges[j].len > end) end = fs->ranges[j].offset + fs->ranges[j].len;
+        j++;
+    }
+    
+    if (j == i) {
+        // Disjoint - insert
+        if (fs->range_count == fs->range_cap) {
+            int cap = fs->range_cap ? fs->range_cap * 2 : 16;
+            byte_range_t *grown = (byte_range_t *)realloc(fs->ranges, sizeof(byte_range_t) * cap);
+            if (!grown) return;  // Range is simply re-sent after a resume
+            fs->ranges = grown;
+            fs->range_cap = cap;
+        }
+        memmove(&fs->ranges[i + 1], &fs->ranges[i], sizeof(byte_range_t) * (fs->range_count - i));
+        fs->range_count++;
+    } else {
+        // Collapse ranges i..j-1 into one
+        memmove(&fs->ranges[i + 1], &fs->ranges[j], sizeof(byte_range_t) * (fs->range_count - j));
+        fs->range_count -= (j - i - 1);
+    }
+    fs->ranges[i].offset = start;
+    fs->ranges[i].len = end - start;
+}
+
+// Record the CRC32C of [offset, offset + len), joining it with adjacent
+// ranges so stripes collapse into one whole-file digest (caller holds fs->mutex)
+void digests_add(file_state_t *fs, uint64_t offset, uint64_t len, uint32_t crc) {
+    if (len == 0 || fs->digests_broken) return;
+    uint64_t end = offset + len;
+    
+    int i = 0;
+    while (i < fs->digest_count && fs->digests[i].offset + fs->digests[i].len <= offset) {
+        i++;
+    }
+    // i is the first range ending after offset - it must not start before end
+    if (i < fs->digest_count && fs->digests[i].offset < end) {
+        fs->digests_broken = true;  // Bytes hashed twice, the digests no longer add up
+        return;
+    }
+    
+    bool join_prev = i > 0 && fs->digests[i - 1].offset + fs->digests[i - 1].len == offset;
+    bool join_next = i < fs->digest_count && fs->digests[i].offset == end;
+    if (join_prev) {
+        digest_range_t *prev = &fs->digests[i - 1];
+        prev->crc = crc32c_combine(prev->crc, crc, len);
+        prev->len += len;
+        if (join_next) {
+            prev->crc = crc32c_combine(prev->crc, fs->digests[i].crc, fs->digests[i].len);
+            prev->len += fs->digests[i].len;
+            memmove(&fs->digests[i], &fs->digests[i + 1], sizeof(digest_range_t) * (fs->digest_count - i - 1));
+            fs->digest_count--;
+        }
+        return;
+    }
+    if (join_next) {
+        digest_range_t *next = &fs->digests[i];
+        next->crc = crc32c_combine(crc, next->crc, next->len);
+        next->offset = offset;
+        next->len += len;
+        return;
+    }
+    
+    if (fs->digest_count == fs->digest_cap) {
+        int cap = fs->digest_cap ? fs->digest_cap * 2 : 16;
+        digest_range_t *grown = (digest_range_t *)realloc(fs->digests, sizeof(digest_range_t) * cap);
+        if (!grown) {
+            fs->digests_broken = true;
+            return;
+        }
+        fs->digests = grown;
+        fs->digest_cap = cap;
+    }
+    memmove(&fs->digests[i + 1], &fs->digests[i], sizeof(digest_range_t) * (fs->digest_count - i));
+    fs->digest_count++;
+    fs->digests[i].offset = offset;
+    fs->digests[i].len = len;
+    fs->digests[i].crc = crc;
+}
+
+// Whole-file CRC32C, if every byte was hashed exactly once (caller holds fs->mutex)
+bool digests_whole_file(const file_state_t *fs, uint32_t *crc) {
+    if (fs->digests_broken) return false;
+    if (fs->file_size == 0) {
+        *crc = 0;
+        return true;
+    }
+    if (fs->digest_count != 1 || fs->digests[0].offset != 0 || fs->digests[0].len != fs->file_size) {
+        return false;
+    }
+    *crc = fs->digests[0].crc;
+    return true;
+}
+
+// Every byte of the file has been written (caller holds fs->mutex)
+bool ranges_complete(const file_state_t *fs) {
+    if (fs->file_size == 0) return true;
+    return fs->range_count == 1 && fs->ranges[0].offset == 0 && fs->ranges[0].len >= fs->file_size;
+}
+
+static void journal_path(char *out, size_t out_size, const char *path) {
+    snprintf(out, out_size, "%s%s", path, RESUME_JOURNAL_SUFFIX);
+}
+
+// Journal layout: magic(4) + count(4) + file_size(8) + count * (offset(8) + len(8))
+// Written to a temp file and renamed over, so a crash leaves the old or new journal.
+int journal_save(const char *path, uint64_t file_size, const byte_range_t *ranges, int count) {
+    char jpath[MAX_PATH + 16], tmp[MAX_PATH + 32];
+    journal_path(jpath, sizeof(jpath), path);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", jpath);
+    
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return -1;
+    
+    uint8_t header[16];
+    uint32_t magic = RESUME_JOURNAL_MAGIC;
+    uint32_t n = (uint32_t)count;
+    memcpy(header, &magic, 4);
+    memcpy(header + 4, &n, 4);
+    memcpy(header + 8, &file_size, 8);
+    
+    size_t body = sizeof(byte_range_t) * count;
+    bool ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              (body == 0 || write(fd, ranges, body) == (ssize_t)body) &&
+              fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp, jpath) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Load the journal into fs (caller holds fs->mutex). Returns 0 if one was found.
+int journal_load(file_state_t *fs) {
+    char jpath[MAX_PATH + 16];
+    journal_path(jpath, sizeof(jpath), fs->path);
+    
+    int fd = open(jpath, O_RDONLY);
+    if (fd < 0) return -1;
+    
+    uint8_t header[16];
+    uint32_t magic, count;
+    if (read(fd, header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(fd);
+        return -1;
+    }
+    memcpy(&magic, header, 4);
+    memcpy(&count, header + 4, 4);
+    if (magic != RESUME_JOURNAL_MAGIC) {
+        close(fd);
+        return -1;
+    }
+    memcpy(&fs->file_size, header + 8, 8);
+    fs->range_count = 0;
+    
+    byte_range_t r;
+    for (uint32_t i = 0; i < count; i++) {
+        if (read(fd, &r, sizeof(r)) != (ssize_t)sizeof(r)) break;
+        ranges_add(fs, r.offset, r.len);
+    }
+    close(fd);
+    return 0;
+}
+
+void journal_remove(const char *path) {
+    char jpath[MAX_PATH + 16];
+    journal_path(jpath, sizeof(jpath), path);
+    unlink(jpath);
+}
+
+// Make the recorded ranges durable: flush file data first, then save the journal,
+// so the journal never claims bytes that could still be lost.
+void file_state_checkpoint(file_state_t *fs, int fd) {
+    pthread_mutex_lock(&fs->mutex);
+    if (!fs->journaled || fs->journal_saving) {
+        pthread_mutex_unlock(&fs->mutex);
+        return;
+    }
+    fs->journal_saving = true;
+    fs->unsaved_bytes = 0;
+    int count = fs->range_count;
+    uint64_t file_size = fs->file_size;
+    byte_range_t *snapshot = (byte_range_t *)malloc(sizeof(byte_range_t) * (count ? count : 1));
+    if (snapshot) {
+        memcpy(snapshot, fs->ranges, sizeof(byte_range_t) * count);
+    }
+    pthread_mutex_unlock(&fs->mutex);
+    
+    if (snapshot && fsync(fd) == 0) {
+        journal_save(fs->path, file_size, snapshot, count);
+    }
+    free(snapshot);
+    
+    pthread_mutex_lock(&fs->mutex);
+    fs->journal_saving = false;
+    pthread_mutex_unlock(&fs->mutex);
+}
+
+static uint64_t monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Token bucket for an optional rate limit, shared by every thread moving
+// bytes under it. Each caller takes its bytes and sleeps off any debt.
+#define RATE_BURST_US 250000  // Credit an idle bucket can bank
+
+typedef struct {
+    uint64_t rate;        // Bytes per second, 0 = unlimited
+    int64_t tokens;
+    uint64_t last_us;
+    pthread_mutex_t mutex;
+} rate_bucket_t;
+
+static void rate_pace(rate_bucket_t *b, uint64_t bytes) {
+    if (b->rate == 0) {
+        return;
+    }
+    pthread_mutex_lock(&b->mutex);
+    uint64_t rate = b->rate;
+    uint64_t now = monotonic_us();
+    int64_t burst = (int64_t)(rate * RATE_BURST_US / 1000000);
+    uint64_t elapsed = b->last_us ? now - b->last_us : RATE_BURST_US;
+    if (elapsed > RATE_BURST_US) {
+        elapsed = RATE_BURST_US;
+    }
+    b->tokens += (int64_t)(elapsed * rate / 1000000);
+    if (b->tokens > burst) {
+        b->tokens = burst;
+    }
+    b->last_us = now;
+    b->tokens -= (int64_t)bytes;
+    uint64_t wait_us = b->tokens < 0 ? (uint64_t)(-b->tokens) * 1000000 / rate : 0;
+    pthread_mutex_unlock(&b->mutex);
+    
+    if (wait_us > 0) {
+        struct timespec ts = { (time_t)(wait_us / 1000000), (long)(wait_us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// ============================================================================
+// TRANSFER SESSIONS
+// ============================================================================
+// A striped upload is set up once with TRANSFER_CREATE: the file is created
+// (or reopened for resume) and pre-allocated there, and the transfer gets an
+// id. Each stripe connection then joins with TRANSFER_JOIN and streams its
+// ranges as usual, in any order. The transfer is complete once a stripe
+// ends with every range of the file recorded. An optional rate limit caps
+// all of its stripes together.
+
+#define TRANSFER_MAX 32             // Registered transfers
+#define TRANSFER_MAX_STRIPES 64     // Connections per transfer
+#define TRANSFER_IDLE_SECS 600      // Unfinished transfer with no stripe connected
+
+typedef struct transfer {
+    uint32_t id;
+    char path[MAX_PATH];
+    uint64_t file_size;
+    uint32_t stripes;      // Connections the client will use
+    uint32_t joined;       // Joins so far, reconnects included
+    uint32_t active;       // Stripes joined and not yet ended
+    bool complete;         // Every byte landed
+    time_t idle_since;     // When active last dropped to 0
+    rate_bucket_t rate;
+    struct transfer *next;
+} transfer_t;
+
+static transfer_t *g_transfers = NULL;
+static int g_transfer_count = 0;
+static uint32_t g_transfer_next_id = 0;
+static pthread_mutex_t g_transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Forget transfers nobody is using any more: finished ones only when room is
+// needed (their status stays queryable until then), stalled ones after
+// TRANSFER_IDLE_SECS (caller holds g_transfer_lock)
+static void transfer_reap(bool need_room) {
+    time_t now = time(NULL);
+    transfer_t **ptr = &g_transfers;
+    while (*ptr) {
+        transfer_t *t = *ptr;
+        bool idle = t->active == 0 && now - t->idle_since >= TRANSFER_IDLE_SECS;
+        if (t->active == 0 && (idle || (need_room && t->complete))) {
+            *ptr = t->next;
+            g_transfer_count--;
+            release_file_state(t->path);
+            pthread_mutex_destroy(&t->rate.mutex);
+            free(t);
+            continue;
+        }
+        ptr = &t->next;
+    }
+}
+
+// Register a transfer for path, whose file state the caller holds a
+// reference to - the transfer keeps it. Returns the id, 0 if the table is full.
+static uint32_t transfer_create(const char *path, uint64_t file_size, uint32_t stripes, uint64_t rate) {
+    transfer_t *t = (transfer_t *)calloc(1, sizeof(transfer_t));
+    if (!t) return 0;
+    snprintf(t->path, sizeof(t->path), "%s", path);
+    t->file_size = file_size;
+    t->stripes = stripes;
+    t->idle_since = time(NULL);
+    t->rate.rate = rate;
+    pthread_mutex_init(&t->rate.mutex, NULL);
+    
+    pthread_mutex_lock(&g_transfer_lock);
+    transfer_reap(g_transfer_count >= TRANSFER_MAX);
+    if (g_transfer_count >= TRANSFER_MAX) {
+        pthread_mutex_unlock(&g_transfer_lock);
+        pthread_mutex_destroy(&t->rate.mutex);
+        free(t);
+        return 0;
+    }
+    if (g_transfer_next_id == 0) {
+        g_transfer_next_id = (uint32_t)time(NULL);  // Ids from before a restart don't match
+    }
+    t->id = g_transfer_next_id++;
+    if (t->id == 0) {
+        t->id = g_transfer_next_id++;
+    }
+    t->next = g_transfers;
+    g_transfers = t;
+    g_transfer_count++;
+    pthread_mutex_unlock(&g_transfer_lock);
+    return t->id;
+}
+
+// Caller holds g_transfer_lock
+static transfer_t *transfer_find(uint32_t id) {
+    transfer_t *t = g_transfers;
+    while (t && t->id != id) {
+        t = t->next;
+    }
+    return t;
+}
+
+// Claim a stripe slot. Copies out what the joining connection needs;
+// returns NULL with *error set if the transfer can't take another stripe.
+static transfer_t *transfer_join(uint32_t id, char *path, size_t path_size, uint64_t *file_size, const char **error) {
+    pthread_mutex_lock(&g_transfer_lock);
+    transfer_t *t = transfer_find(id);
+    if (!t) {
+        *error = "Unknown transfer";
+    } else if (t->complete) {
+        *error = "Transfer already complete";
+        t = NULL;
+    } else if (t->active >= t->stripes) {
+        *error = "All stripes already joined";
+        t = NULL;
+    } else {
+        t->joined++;
+        t->active++;
+        snprintf(path, path_size, "%s", t->path);
+        *file_size = t->file_size;
+    }
+    pthread_mutex_unlock(&g_transfer_lock);
+    return t;
+}
+
+// A stripe ended; complete says every range of the file was recorded by then
+static void transfer_stripe_end(transfer_t *t, bool complete) {
+    pthread_mutex_lock(&g_transfer_lock);
+    t->active--;
+    if (complete) {
+        t->complete = true;
+    }
+    if (t->active == 0) {
+        t->idle_since = time(NULL);
+    }
+    pthread_mutex_unlock(&g_transfer_lock);
 }
 
 // Protocol commands
@@ -110,18 +1029,34 @@ void release_file_mutex(const char *path) {
 #define CMD_RENAME 0x07
 #define CMD_COPY_FILE 0x08
 #define CMD_MOVE_FILE 0x09
+#define CMD_LIST_DIR_PAGED 0x0A
 #define CMD_START_UPLOAD 0x10
 #define CMD_UPLOAD_CHUNK 0x11
 #define CMD_END_UPLOAD 0x12
 #define CMD_DOWNLOAD_FILE 0x13
+#define CMD_UPLOAD_CHUNK_AT 0x14
+#define CMD_UPLOAD_STREAM 0x15
+#define CMD_UPLOAD_BATCH 0x16
+#define CMD_UPLOAD_QUERY 0x17
+#define CMD_BLOCK_SIGNATURES 0x18
+#define CMD_UPLOAD_DELTA 0x19
+#define CMD_DOWNLOAD_RANGE 0x1A
+#define CMD_DOWNLOAD_TREE 0x1B
+#define CMD_TRANSFER_CREATE 0x1C
+#define CMD_TRANSFER_JOIN 0x1D
+#define CMD_TRANSFER_STATUS 0x1E
+#define CMD_UPLOAD_CHUNK_Z 0x1F
 #define CMD_SHELL_OPEN 0x20
 #define CMD_SHELL_EXEC 0x21
 #define CMD_SHELL_INTERRUPT 0x22
 #define CMD_SHELL_CLOSE 0x23
+#define CMD_HELLO 0x30
 #define CMD_INDEX_START 0x40
 #define CMD_INDEX_STATUS 0x41
 #define CMD_SEARCH_INDEX 0x42
 #define CMD_INDEX_CANCEL 0x43
+#define CMD_STATS 0x50
+#define CMD_RATE_LIMIT 0x51
 #define CMD_SHUTDOWN 0xFF
 
 // Protocol responses
@@ -131,6 +1066,13 @@ void release_file_mutex(const char *path) {
 #define RESP_READY 0x04
 #define RESP_PROGRESS 0x05
 
+// Optional protocol features, negotiated per connection with HELLO
+#define PROTOCOL_VERSION 2
+#define FEATURE_LZ4 0x01       // UPLOAD_CHUNK_Z may carry LZ4, DOWNLOAD_FILE sends framed blocks
+#define FEATURE_SENDFILE 0x02  // Uncompressed downloads use paced sendfile() instead of the copy loop
+#define FEATURE_MUX 0x04       // Headers carry a request id, requests may run concurrently
+#define FEATURES_SUPPORTED (FEATURE_LZ4 | FEATURE_SENDFILE | FEATURE_MUX)
+
 typedef struct notify_request {
     char useless1[45];
     char message[3075];
@@ -145,55 +1087,299 @@ void send_notification(const char *msg) {
     sceKernelSendNotificationRequest(0, &req, sizeof(req), 0);
 }
 
-typedef struct {
-    int sock;
-    int upload_fd;  // File descriptor for direct write (faster than FILE*)
-    pthread_mutex_t *file_mutex;  // Per-file mutex
-    char upload_path[MAX_PATH];
-    uint64_t upload_size;
-    uint64_t upload_received;
-    // Shell session
-    FILE *shell_pipe;
-    pid_t shell_pid;
-    bool shell_active;
-    char shell_cwd[MAX_PATH];
-} client_session_t;
+// ============================================================================
+// BUFFER POOL
+// ============================================================================
+// Every large I/O buffer is borrowed from one preallocated, page-aligned pool
+// split into size classes and capped by POOL_BUDGET_BYTES. When the pool runs
+// dry, callers get a smaller buffer or wait instead of growing memory until
+// the console starts dropping connections.
 
-// Filesystem index entry (in-memory, no SQLite for simplicity)
-typedef struct index_entry {
-    char path[MAX_PATH];
-    char name[256];
-    uint64_t size;
-    time_t mtime;
-    bool is_dir;
-    struct index_entry *next;
-} index_entry_t;
+#define POOL_CLASS_COUNT 4
+#define POOL_MIN_BUFFER (64 * 1024)
 
-// Index state
 typedef struct {
-    index_entry_t *entries;
-    int total_files;
-    int total_dirs;
-    bool indexing;
-    bool ready;
-    pthread_mutex_t mutex;
-    pthread_t thread;
-} index_state_t;
+    size_t size;      // Buffer size of this class
+    int share;        // Percent of POOL_BUDGET_BYTES
+    uint8_t *base;    // One contiguous mapping for the whole class
+    int count;
+    int *free_list;   // Stack of free buffer indices
+    int free_count;
+    int peak;         // Most buffers in use at once
+} pool_class_t;
 
-static index_state_t g_index = {0};
+static pool_class_t g_pool[POOL_CLASS_COUNT] = {
+    { POOL_MIN_BUFFER, 5 },
+    { 256 * 1024, 5 },
+    { 1024 * 1024, 15 },
+    { BUFFER_SIZE, 75 },
+};
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pool_cond = PTHREAD_COND_INITIALIZER;
+static int g_pool_waiting = 0;
+static uint64_t g_pool_waits = 0;     // Times a caller had to block
+static uint64_t g_pool_degraded = 0;  // Times a smaller buffer than wanted was handed out
+
+void pool_init() {
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        pool_class_t *c = &g_pool[i];
+        c->count = (int)((uint64_t)POOL_BUDGET_BYTES * c->share / 100 / c->size);
+        if (c->count < 1) c->count = 1;
+        
+        size_t bytes = (size_t)c->count * c->size;
+        void *base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        c->free_list = (int *)malloc(sizeof(int) * c->count);
+        if (base == MAP_FAILED || !c->free_list) {
+            // Class unavailable - callers fall back to the other classes
+            if (base != MAP_FAILED) munmap(base, bytes);
+            free(c->free_list);
+            c->free_list = NULL;
+            c->count = 0;
+            continue;
+        }
+        
+        // Touch every page now so the budget is really committed up front
+        memset(base, 0, bytes);
+        c->base = (uint8_t *)base;
+        for (int j = 0; j < c->count; j++) {
+            c->free_list[j] = c->count - 1 - j;
+        }
+        c->free_count = c->count;
+    }
+}
+
+static uint8_t *pool_take(pool_class_t *c) {
+    int idx = c->free_list[--c->free_count];
+    int in_use = c->count - c->free_count;
+    if (in_use > c->peak) c->peak = in_use;
+    return c->base + (size_t)idx * c->size;
+}
+
+// Borrow a buffer of at least min_size bytes, preferably want_size. Falls back
+// to a smaller class (down to min_size) when the preferred ones are exhausted.
+// With wait set, blocks until something fits; otherwise returns NULL.
+static uint8_t *pool_get(size_t min_size, size_t want_size, size_t *got_size, bool wait) {
+    if (want_size < min_size) want_size = min_size;
+    
+    pthread_mutex_lock(&g_pool_lock);
+    bool waited = false;
+    while (1) {
+        bool possible = false;
+        
+        // Smallest class that holds want_size
+        for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+            pool_class_t *c = &g_pool[i];
+            if (c->size < want_size || c->count == 0) continue;
+            possible = true;
+            if (c->free_count > 0) {
+                if (got_size) *got_size = c->size;
+                uint8_t *buf = pool_take(c);
+                pthread_mutex_unlock(&g_pool_lock);
+                return buf;
+            }
+        }
+        
+        // Degrade: largest smaller class that still holds min_size
+        for (int i = POOL_CLASS_COUNT - 1; i >= 0; i--) {
+            pool_class_t *c = &g_pool[i];
+            if (c->size >= want_size || c->size < min_size || c->count == 0) continue;
+            possible = true;
+            if (c->free_count > 0) {
+                if (got_size) *got_size = c->size;
+                uint8_t *buf = pool_take(c);
+                g_pool_degraded++;
+                pthread_mutex_unlock(&g_pool_lock);
+                return buf;
+            }
+        }
+        
+        if (!possible || !wait) {
+            pthread_mutex_unlock(&g_pool_lock);
+            return NULL;
+        }
+        
+        if (!waited) {
+            g_pool_waits++;
+            waited = true;
+        }
+        g_pool_waiting++;
+        pthread_cond_wait(&g_pool_cond, &g_pool_lock);
+        g_pool_waiting--;
+    }
+}
+
+uint8_t *pool_acquire(size_t min_size, size_t want_size, size_t *got_size) {
+    return pool_get(min_size, want_size, got_size, true);
+}
+
+uint8_t *pool_try_acquire(size_t min_size, size_t want_size, size_t *got_size) {
+    return pool_get(min_size, want_size, got_size, false);
+}
+
+// Return a buffer to its class (NULL is ignored)
+void pool_release(uint8_t *buf) {
+    if (!buf) return;
+    
+    pthread_mutex_lock(&g_pool_lock);
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        pool_class_t *c = &g_pool[i];
+        if (c->count == 0) continue;
+        if (buf >= c->base && buf < c->base + (size_t)c->count * c->size) {
+            c->free_list[c->free_count++] = (int)((size_t)(buf - c->base) / c->size);
+            break;
+        }
+    }
+    if (g_pool_waiting > 0) {
+        pthread_cond_broadcast(&g_pool_cond);
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+}
+
+// Append pool occupancy as "key=value" lines
+size_t pool_format_stats(char *out, size_t out_size) {
+    size_t len = 0;
+    pthread_mutex_lock(&g_pool_lock);
+    len += snprintf(out + len, out_size - len, "pool_budget=%llu\n",
+                    (unsigned long long)POOL_BUDGET_BYTES);
+    for (int i = 0; i < POOL_CLASS_COUNT && len < out_size; i++) {
+        pool_class_t *c = &g_pool[i];
+        len += snprintf(out + len, out_size - len, "pool_%zuk=in_use:%d free:%d total:%d peak:%d\n",
+                        c->size / 1024, c->count - c->free_count, c->free_count, c->count, c->peak);
+    }
+    if (len < out_size) {
+        len += snprintf(out + len, out_size - len, "pool_waiting=%d\npool_waits=%llu\npool_degraded=%llu\n",
+                        g_pool_waiting, (unsigned long long)g_pool_waits,
+                        (unsigned long long)g_pool_degraded);
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+    return len < out_size ? len : out_size - 1;
+}
+
+struct upload_pipe;
 
-// Disk write job for queue
+// Disk write job for queue - positional write of one received buffer
 typedef struct write_job {
-    uint8_t *data;
+    int fd;
+    uint64_t offset;
+    uint8_t *data;             // Pool buffer, released once written
     size_t len;
-    FILE *fp;
+    uint32_t raw_len;          // Nonzero: data is an LZ4 block expanding to raw_len bytes
+    file_state_t *file;        // Received ranges are recorded here
+    struct upload_pipe *pipe;  // Owner, notified on completion
+    int slot;
     struct write_job *next;
 } write_job_t;
 
-// Job queue (producer-consumer pattern)
+// Per-session receive/write pipeline. The socket thread receives into the
+// next free slot while disk workers write the previous ones.
+typedef struct upload_pipe {
+    bool busy[UPLOAD_PIPELINE_DEPTH];
+    write_job_t jobs[UPLOAD_PIPELINE_DEPTH];
+    int next;      // Slot the next payload is received into
+    int pending;   // Jobs queued or being written
+    int error;     // errno of the first failed write, 0 if none
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+} upload_pipe_t;
+
+// Socket buffer tuning for one direction of a connection, see link_tune()
+typedef struct {
+    uint64_t start_us;   // First transfer seen, 0 before that
+    uint64_t last_us;    // Start of the current sample
+    uint64_t bytes;      // Moved since last_us
+    uint64_t peak_bdp;   // Largest bandwidth-delay product measured
+    int buf;             // Socket buffer size in effect
+    bool done;           // Measurement window over
+} link_tune_t;
+
+#define LINK_RX 0  // Uploads - SO_RCVBUF
+#define LINK_TX 1  // Downloads - SO_SNDBUF
+
+typedef struct client_session {
+    int sock;
+    // Connection core: header assembled by whichever thread owns the connection
+    uint8_t header[9];
+    size_t header_have;
+    bool io_registered;    // Added to the epoll set
+    bool closing;          // Peer gone, the worker tears the connection down
+    struct client_session *next_ready;  // Connection worker queue link
+    uint64_t queued_us;    // When it was queued for a worker
+    uint32_t features;  // FEATURE_* agreed with HELLO
+    link_tune_t tune[2];  // Indexed by LINK_RX / LINK_TX
+    pthread_mutex_t tune_lock;  // Guards tune - FEATURE_MUX downloads share it
+    pthread_mutex_t send_lock;  // One response on the wire at a time, guards out
+    uint8_t out[OUTPUT_BUFFER_SIZE];  // Queued responses, see output_put()
+    size_t out_len;
+    int sendfile_users;    // Downloads in download_sendfile(), guarded by send_lock
+    int saved_lowat;       // SO_SNDLOWAT to restore when the last one ends
+    int sendfile_lowat;    // SO_SNDLOWAT they run with, follows SO_SNDBUF
+    // FEATURE_MUX: requests running on their own threads
+    int inflight;
+    pthread_mutex_t inflight_lock;
+    pthread_cond_t inflight_done;
+    int upload_fd;  // File descriptor for direct write (faster than FILE*)
+    file_state_t *file_state;  // Shared per-file state (mutex, received ranges)
+    char upload_path[MAX_PATH];
+    uint64_t upload_size;
+    uint64_t upload_offset;    // Next write position for sequential UPLOAD_CHUNK
+    uint64_t upload_received;
+    uint32_t upload_blksize;   // Filesystem block size, receive pieces are aligned to it
+    uint32_t upload_flags;     // UPLOAD_FLAG_* from START_UPLOAD
+    digest_range_t digest;     // CRC32C of the contiguous range being received
+    digest_range_t digest_last;  // Last range handed to the file state
+    sha256_ctx_t *sha;         // Only with UPLOAD_FLAG_SHA256
+    bool sha_ok;               // Bytes arrived in order from offset 0
+    bool upload_complete;      // Set by upload_close when every byte of the file landed
+    bool upload_discarded;     // Set by upload_close when it removed an unfinished delta file
+    bool upload_replace_failed;  // Set by upload_close when the delta result could not replace the file
+    int basis_fd;              // Delta upload: old copy of the file, -1 otherwise
+    char upload_final[MAX_PATH];  // Delta upload: path the rebuilt file replaces
+    struct transfer *transfer;    // Transfer this upload is a stripe of, NULL if none
+    bool admitted;                // Holds an admission slot, see admit_acquire()
+    struct admit_waiter *admit_wait;  // Queued upload request, see admit_park()
+    bool admit_granted;           // The re-run request's slot is already taken
+    rate_bucket_t rate;           // RATE_LIMIT for this connection's transfers
+    upload_pipe_t pipe;
+    // Shell session
+    FILE *shell_pipe;
+    pid_t shell_pid;
+    bool shell_active;
+    char shell_cwd[MAX_PATH];
+} client_session_t;
+
+// Filesystem index entry (in-memory, no SQLite for simplicity)
+typedef struct index_entry {
+    char path[MAX_PATH];
+    char name[256];
+    uint64_t size;
+    time_t mtime;
+    bool is_dir;
+    struct index_entry *next;
+} index_entry_t;
+
+// Index state
+typedef struct {
+    index_entry_t *entries;
+    int total_files;
+    int total_dirs;
+    bool indexing;
+    bool ready;
+    pthread_mutex_t mutex;
+    pthread_t thread;
+} index_state_t;
+
+static index_state_t g_index = {0};
+
+// Job queue (producer-consumer pattern). Jobs wait in per-file flows,
+// served in deficit round-robin: each turn a flow may write DRR_QUANTUM
+// bytes more, so a file with large chunks or many stripes can't crowd out
+// the others.
+#define DRR_QUANTUM (1024 * 1024)
+
 typedef struct {
-    write_job_t *head;
-    write_job_t *tail;
+    sched_flow_t *round_head;  // Flows with queued jobs, in serving order
+    sched_flow_t *round_tail;
+    sched_flow_t loose;        // Jobs without a file state
     size_t count;
     size_t max;
     int closed;
@@ -216,9 +1402,22 @@ void queue_init(job_queue_t *q, size_t max) {
     pthread_cond_init(&q->not_full, NULL);
 }
 
+// Append flow to the end of the round (caller holds q->mutex)
+static void queue_round_append(job_queue_t *q, sched_flow_t *flow) {
+    flow->next = NULL;
+    if (q->round_tail) {
+        q->round_tail->next = flow;
+    } else {
+        q->round_head = flow;
+    }
+    q->round_tail = flow;
+}
+
 int queue_push(job_queue_t *q, write_job_t *job) {
+    sched_flow_t *flow = job->file ? &job->file->flow : &q->loose;
     pthread_mutex_lock(&q->mutex);
-    while (!q->closed && q->count >= q->max) {
+    // A full queue only holds back files that already have writes waiting
+    while (!q->closed && q->count >= q->max && flow->queued > 0) {
         pthread_cond_wait(&q->not_full, &q->mutex);
     }
     if (q->closed) {
@@ -226,12 +1425,18 @@ int queue_push(job_queue_t *q, write_job_t *job) {
         return -1;
     }
     job->next = NULL;
-    if (!q->tail) {
-        q->head = job;
-        q->tail = job;
+    if (!flow->tail) {
+        flow->head = job;
+        flow->tail = job;
     } else {
-        q->tail->next = job;
-        q->tail = job;
+        flow->tail->next = job;
+        flow->tail = job;
+    }
+    flow->queued++;
+    if (!flow->active) {
+        flow->active = true;
+        flow->deficit = 0;
+        queue_round_append(q, flow);
     }
     q->count++;
     pthread_cond_signal(&q->not_empty);
@@ -248,17 +1453,55 @@ write_job_t *queue_pop(job_queue_t *q) {
         pthread_mutex_unlock(&q->mutex);
         return NULL;
     }
-    write_job_t *job = q->head;
-    q->head = job->next;
-    if (!q->head) {
-        q->tail = NULL;
+    
+    // The flow at the head writes while its deficit covers the next job,
+    // otherwise it earns a quantum and goes to the back
+    sched_flow_t *flow = q->round_head;
+    while ((int64_t)flow->head->len > flow->deficit) {
+        flow->deficit += DRR_QUANTUM;
+        if (flow->next) {
+            q->round_head = flow->next;
+            queue_round_append(q, flow);
+            flow = q->round_head;
+        }
+    }
+    
+    write_job_t *job = flow->head;
+    flow->head = job->next;
+    flow->queued--;
+    flow->deficit -= (int64_t)job->len;
+    if (!flow->head) {
+        // Idle flows don't bank credit
+        flow->tail = NULL;
+        flow->active = false;
+        flow->deficit = 0;
+        q->round_head = flow->next;
+        if (!q->round_head) {
+            q->round_tail = NULL;
+        }
     }
     q->count--;
-    pthread_cond_signal(&q->not_full);
+    pthread_cond_broadcast(&q->not_full);
     pthread_mutex_unlock(&q->mutex);
     return job;
 }
 
+// Positional write of a full buffer - no shared seek state, safe for concurrent
+// writers on the same file as long as their ranges don't overlap
+ssize_t write_full_at(int fd, const uint8_t *data, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t w = pwrite(fd, data + done, len - done, (off_t)(offset + done));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (w == 0) break;
+        done += w;
+    }
+    return (ssize_t)done;
+}
+
 // Disk worker thread
 void *disk_worker(void *arg) {
     (void)arg;
@@ -266,13 +1509,67 @@ void *disk_worker(void *arg) {
         write_job_t *job = queue_pop(&g_queue);
         if (!job) break;
         
-        if (job->fp && job->data && job->len > 0) {
-            fwrite(job->data, 1, job->len, job->fp);
-            // No fflush here - let setvbuf handle buffering
+        int err = 0;
+        const uint8_t *out = job->data;
+        size_t out_len = job->len;
+        uint8_t *raw = NULL;
+        bool raw_pooled = false;
+        if (job->raw_len) {
+            // Decompress here so the socket thread only ever receives. Never wait
+            // on the pool - the buffers it would wait for are queued behind us.
+            raw = pool_try_acquire(job->raw_len, job->raw_len, NULL);
+            raw_pooled = raw != NULL;
+            if (!raw) {
+                raw = (uint8_t *)malloc(job->raw_len);
+            }
+            if (!raw) {
+                err = ENOMEM;
+            } else if (lz4_decompress(job->data, job->len, raw, job->raw_len) != 0) {
+                err = EINVAL;
+            }
+            out = raw;
+            out_len = job->raw_len;
+        }
+        
+        // A corrupt block or missing memory is reported like a failed write
+        if (!err && write_full_at(job->fd, out, out_len, job->offset) != (ssize_t)out_len) {
+            err = errno ? errno : EIO;
+        }
+        if (!err && job->file) {
+            // Record the landed range; checkpoint the resume journal now and then
+            file_state_t *fs = job->file;
+            uint32_t crc = job->raw_len ? crc32c_update(0, out, out_len) : 0;
+            pthread_mutex_lock(&fs->mutex);
+            ranges_add(fs, job->offset, out_len);
+            if (job->raw_len) {
+                // Plain chunks are hashed by the session, packed ones only here
+                digests_add(fs, job->offset, out_len, crc);
+            }
+            fs->unsaved_bytes += out_len;
+            bool save = fs->journaled && !fs->journal_saving &&
+                        fs->unsaved_bytes >= RESUME_SAVE_INTERVAL;
+            pthread_mutex_unlock(&fs->mutex);
+            if (save) {
+                file_state_checkpoint(fs, job->fd);
+            }
         }
         
-        free(job->data);
-        free(job);
+        // Report completion back to the owning session
+        upload_pipe_t *pipe = job->pipe;
+        pool_release(job->data);
+        if (raw_pooled) {
+            pool_release(raw);
+        } else {
+            free(raw);
+        }
+        pthread_mutex_lock(&pipe->mutex);
+        if (err && !pipe->error) {
+            pipe->error = err;
+        }
+        pipe->busy[job->slot] = false;
+        pipe->pending--;
+        pthread_cond_broadcast(&pipe->done);
+        pthread_mutex_unlock(&pipe->mutex);
     }
     return NULL;
 }
@@ -287,43 +1584,420 @@ void init_workers() {
     g_workers_initialized = 1;
 }
 
-// Send response - combined header+data in single send for speed
-void send_response(int sock, uint8_t response, const void *data, uint32_t data_len) {
-    // Combine header and data into single buffer for single send()
-    size_t total_len = 5 + data_len;
-    uint8_t *combined = malloc(total_len);
-    if (!combined) {
-        // Fallback to separate sends
-        uint8_t header[5];
-        header[0] = response;
-        memcpy(header + 1, &data_len, 4);
-        send(sock, header, 5, 0);
-        if (data && data_len > 0) {
-            send(sock, data, data_len, 0);
-        }
-        return;
+// ============================================================================
+// UPLOAD PIPELINE
+// ============================================================================
+
+void upload_pipe_init(upload_pipe_t *pipe) {
+    memset(pipe, 0, sizeof(*pipe));
+    pthread_mutex_init(&pipe->mutex, NULL);
+    pthread_cond_init(&pipe->done, NULL);
+}
+
+// Buffer for the next piece of chunk data - waits until the pipeline has a free
+// slot, then borrows from the pool (between min_size and want_size bytes)
+uint8_t *upload_pipe_buffer_min(upload_pipe_t *pipe, size_t min_size, size_t want_size, size_t *got_size) {
+    int slot = pipe->next;
+    pthread_mutex_lock(&pipe->mutex);
+    while (pipe->busy[slot]) {
+        pthread_cond_wait(&pipe->done, &pipe->mutex);
+    }
+    pthread_mutex_unlock(&pipe->mutex);
+    
+    return pool_acquire(min_size, want_size, got_size);
+}
+
+// Same, for data that can be split - possibly smaller than want_size when busy
+uint8_t *upload_pipe_buffer(upload_pipe_t *pipe, size_t want_size, size_t *got_size) {
+    size_t min_size = want_size < POOL_MIN_BUFFER ? want_size : POOL_MIN_BUFFER;
+    return upload_pipe_buffer_min(pipe, min_size, want_size, got_size);
+}
+
+static int upload_pipe_queue(upload_pipe_t *pipe, int fd, file_state_t *file, uint64_t offset,
+                             uint8_t *data, size_t len, uint32_t raw_len) {
+    int slot = pipe->next;
+    write_job_t *job = &pipe->jobs[slot];
+    job->fd = fd;
+    job->file = file;
+    job->offset = offset;
+    job->data = data;
+    job->len = len;
+    job->raw_len = raw_len;
+    job->pipe = pipe;
+    job->slot = slot;
+    
+    pthread_mutex_lock(&pipe->mutex);
+    pipe->busy[slot] = true;
+    pipe->pending++;
+    pthread_mutex_unlock(&pipe->mutex);
+    
+    if (queue_push(&g_queue, job) != 0) {
+        pool_release(data);
+        pthread_mutex_lock(&pipe->mutex);
+        pipe->busy[slot] = false;
+        pipe->pending--;
+        pthread_mutex_unlock(&pipe->mutex);
+        return -1;
     }
     
-    combined[0] = response;
-    memcpy(combined + 1, &data_len, 4);
-    if (data && data_len > 0) {
-        memcpy(combined + 5, data, data_len);
+    pipe->next = (slot + 1) % UPLOAD_PIPELINE_DEPTH;
+    return 0;
+}
+
+// Hand a filled buffer to the disk workers. Ownership of data passes to the
+// pipeline; it goes back to the pool once written (or right away on failure).
+int upload_pipe_submit(upload_pipe_t *pipe, int fd, file_state_t *file, uint64_t offset,
+                       uint8_t *data, size_t len) {
+    return upload_pipe_queue(pipe, fd, file, offset, data, len, 0);
+}
+
+// Same for an LZ4 block - the worker expands it to raw_len bytes before writing
+int upload_pipe_submit_packed(upload_pipe_t *pipe, int fd, file_state_t *file, uint64_t offset,
+                              uint8_t *data, size_t len, uint32_t raw_len) {
+    return upload_pipe_queue(pipe, fd, file, offset, data, len, raw_len);
+}
+
+// Error from a finished write, if any (non-blocking)
+int upload_pipe_error(upload_pipe_t *pipe) {
+    pthread_mutex_lock(&pipe->mutex);
+    int err = pipe->error;
+    pthread_mutex_unlock(&pipe->mutex);
+    return err;
+}
+
+// Wait for all in-flight writes; returns and clears the first write error
+int upload_pipe_drain(upload_pipe_t *pipe) {
+    pthread_mutex_lock(&pipe->mutex);
+    while (pipe->pending > 0) {
+        pthread_cond_wait(&pipe->done, &pipe->mutex);
+    }
+    int err = pipe->error;
+    pipe->error = 0;
+    pthread_mutex_unlock(&pipe->mutex);
+    return err;
+}
+
+void upload_pipe_destroy(upload_pipe_t *pipe) {
+    upload_pipe_drain(pipe);
+    pthread_mutex_destroy(&pipe->mutex);
+    pthread_cond_destroy(&pipe->done);
+}
+
+// Request being handled on this thread. With FEATURE_MUX every response is
+// tagged with it, so requests running concurrently on one connection (see
+// conn_command) can each answer without passing the id through every handler.
+static __thread uint32_t t_req_id = 0;
+
+int writev_full(int sock, struct iovec *iov, int count);
+
+// Build a response header: resp(1) + len(4), or resp(1) + req_id(4) + len(4)
+// with FEATURE_MUX. Returns the header length.
+static size_t response_header(client_session_t *session, uint8_t *header, uint8_t response, uint32_t data_len) {
+    header[0] = response;
+    if (session->features & FEATURE_MUX) {
+        memcpy(header + 1, &t_req_id, 4);
+        memcpy(header + 5, &data_len, 4);
+        return 9;
+    }
+    memcpy(header + 1, &data_len, 4);
+    return 5;
+}
+
+// Response writer. Frames collect in the session's output buffer and reach
+// the socket at message boundaries, so a burst of small replies costs one
+// syscall and no allocation. Anything that doesn't fit goes out straight
+// from the caller's memory, in the same writev() as what is buffered.
+// The send lock keeps concurrent responses on one connection whole.
+
+// Caller holds send_lock. With flush set everything is on the wire on return.
+static int output_put(client_session_t *session, const void *header, size_t header_len,
+                      const void *data, size_t len, bool flush) {
+    if (!flush && session->out_len + header_len + len <= OUTPUT_BUFFER_SIZE) {
+        memcpy(session->out + session->out_len, header, header_len);
+        if (len > 0) {
+            memcpy(session->out + session->out_len + header_len, data, len);
+        }
+        session->out_len += header_len + len;
+        return 0;
     }
     
-    send(sock, combined, total_len, 0);
-    free(combined);
+    struct iovec iov[3];
+    int count = 0;
+    if (session->out_len > 0) {
+        iov[count].iov_base = session->out;
+        iov[count++].iov_len = session->out_len;
+    }
+    if (header_len > 0) {
+        iov[count].iov_base = (void *)header;
+        iov[count++].iov_len = header_len;
+    }
+    if (len > 0) {
+        iov[count].iov_base = (void *)data;
+        iov[count++].iov_len = len;
+    }
+    session->out_len = 0;
+    return count > 0 ? writev_full(session->sock, iov, count) : 0;
+}
+
+static int response_put(client_session_t *session, uint8_t response, const void *data, uint32_t data_len, bool flush) {
+    uint8_t header[9];
+    if (!data) {
+        data_len = 0;
+    }
+    size_t header_len = response_header(session, header, response, data_len);
+    pthread_mutex_lock(&session->send_lock);
+    int rc = output_put(session, header, header_len, data, data_len, flush);
+    pthread_mutex_unlock(&session->send_lock);
+    return rc;
+}
+
+// Raw bytes that follow a response (download data). With FEATURE_MUX they
+// travel as RESP_DATA frames so they can interleave with other responses.
+static int stream_put(client_session_t *session, const void *data, size_t len, bool flush) {
+    uint8_t header[9];
+    size_t header_len = 0;
+    if (session->features & FEATURE_MUX) {
+        header_len = response_header(session, header, RESP_DATA, (uint32_t)len);
+    }
+    pthread_mutex_lock(&session->send_lock);
+    int rc = output_put(session, header, header_len, data, len, flush);
+    pthread_mutex_unlock(&session->send_lock);
+    return rc;
+}
+
+// Queue a response behind the ones already buffered. A later send_* call
+// (every handler ends with one) or response_flush() puts it on the wire.
+int response_queue(client_session_t *session, uint8_t response, const void *data, uint32_t data_len) {
+    return response_put(session, response, data, data_len, false);
+}
+
+int stream_queue(client_session_t *session, const void *data, size_t len) {
+    return stream_put(session, data, len, false);
+}
+
+int response_flush(client_session_t *session) {
+    pthread_mutex_lock(&session->send_lock);
+    int rc = output_put(session, NULL, 0, NULL, 0, true);
+    pthread_mutex_unlock(&session->send_lock);
+    return rc;
+}
+
+// Send response, together with anything queued before it
+void send_response(client_session_t *session, uint8_t response, const void *data, uint32_t data_len) {
+    response_put(session, response, data, data_len, true);
 }
 
 // Send OK response
-void send_ok(int sock, const char *msg) {
+void send_ok(client_session_t *session, const char *msg) {
     uint32_t len = msg ? strlen(msg) : 0;
-    send_response(sock, RESP_OK, msg, len);
+    send_response(session, RESP_OK, msg, len);
 }
 
 // Send error response
-void send_error(int sock, const char *msg) {
+void send_error(client_session_t *session, const char *msg) {
     uint32_t len = msg ? strlen(msg) : 0;
-    send_response(sock, RESP_ERROR, msg, len);
+    send_response(session, RESP_ERROR, msg, len);
+}
+
+int send_stream(client_session_t *session, const void *data, size_t len) {
+    return stream_put(session, data, len, true);
+}
+
+// Receive exactly len bytes (0 on success, -1 if the connection broke)
+int recv_full(int sock, void *buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t n = recv(sock, (uint8_t *)buf + received, len - received, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+// writev() until every byte is sent (0 on success, -1 if the connection broke)
+int writev_full(int sock, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(sock, iov, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Read and drop len bytes so the command stream stays in sync
+int recv_discard(int sock, uint64_t len) {
+    uint8_t scratch[16 * 1024];
+    while (len > 0) {
+        size_t n = len < sizeof(scratch) ? (size_t)len : sizeof(scratch);
+        if (recv_full(sock, scratch, n) != 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// ============================================================================
+// LINK TUNING
+// ============================================================================
+// Sockets start with LINK_BUF_INITIAL buffers. For the first LINK_TUNE_WINDOW_US
+// of each direction's traffic, every LINK_TUNE_INTERVAL_US the throughput is
+// measured and multiplied by the RTT from TCP_INFO. A buffer that the
+// bandwidth-delay product fills at least halfway is what limits the transfer,
+// so it doubles (up to LINK_BUF_MAX). When the window closes, the buffer
+// settles at twice the largest BDP seen. MSS is left to path MTU discovery
+// unless built with -DLINK_MSS=<bytes>.
+
+#define LINK_BUF_INITIAL (2 * 1024 * 1024)
+#define LINK_BUF_MIN (256 * 1024)
+#define LINK_BUF_MAX (16 * 1024 * 1024)
+#define LINK_TUNE_INTERVAL_US 250000
+#define LINK_TUNE_WINDOW_US 3000000
+
+typedef struct {
+    uint64_t links;     // Connections whose window closed
+    uint32_t rtt_us;    // Last one's values
+    uint32_t mss;
+    uint64_t rate;      // Bytes per second
+    int buf;
+} link_stats_t;
+
+static link_stats_t g_link_stats[2];
+static pthread_mutex_t g_link_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void link_set_buf(int sock, int dir, int size) {
+    setsockopt(sock, SOL_SOCKET, dir == LINK_RX ? SO_RCVBUF : SO_SNDBUF, &size, sizeof(size));
+}
+
+// Socket options for an accepted connection, before any traffic
+static void link_init(client_session_t *session) {
+    for (int dir = LINK_RX; dir <= LINK_TX; dir++) {
+        session->tune[dir].buf = LINK_BUF_INITIAL;
+        link_set_buf(session->sock, dir, LINK_BUF_INITIAL);
+    }
+#ifdef LINK_MSS
+    int mss = LINK_MSS;
+    setsockopt(session->sock, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+#endif
+}
+
+// Caller holds session->tune_lock
+static void link_tune_locked(client_session_t *session, int dir, uint64_t bytes) {
+    link_tune_t *t = &session->tune[dir];
+    if (t->done) {
+        return;
+    }
+    uint64_t now = monotonic_us();
+    if (t->start_us == 0) {
+        t->start_us = now;  // Bytes before the clock started don't count
+        t->last_us = now;
+        return;
+    }
+    t->bytes += bytes;
+    uint64_t elapsed = now - t->last_us;
+    if (elapsed < LINK_TUNE_INTERVAL_US) {
+        return;
+    }
+    
+    uint32_t rtt_us = 0;
+    uint32_t mss = 0;
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if (getsockopt(session->sock, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0) {
+        rtt_us = info.tcpi_rtt;
+        mss = info.tcpi_snd_mss;
+    }
+#endif
+    uint64_t rate = t->bytes * 1000000 / elapsed;
+    uint64_t bdp = rate * rtt_us / 1000000;
+    if (bdp > t->peak_bdp) {
+        t->peak_bdp = bdp;
+    }
+    bool limited = bdp * 2 >= (uint64_t)t->buf;
+    t->last_us = now;
+    t->bytes = 0;
+    
+    int want = t->buf;
+    if (limited && t->buf < LINK_BUF_MAX) {
+        want = t->buf * 2;
+    }
+    if (now - t->start_us >= LINK_TUNE_WINDOW_US) {
+        t->done = true;
+        if (!limited) {
+            want = (int)(t->peak_bdp * 2 < LINK_BUF_MAX ? t->peak_bdp * 2 : LINK_BUF_MAX);
+        }
+    }
+    if (want < LINK_BUF_MIN) want = LINK_BUF_MIN;
+    if (want > LINK_BUF_MAX) want = LINK_BUF_MAX;
+    if (want != t->buf) {
+        link_set_buf(session->sock, dir, want);
+        t->buf = want;
+    }
+    
+    if (t->done) {
+        pthread_mutex_lock(&g_link_stats_lock);
+        link_stats_t *st = &g_link_stats[dir];
+        st->links++;
+        st->rtt_us = rtt_us;
+        st->mss = mss;
+        st->rate = rate;
+        st->buf = t->buf;
+        pthread_mutex_unlock(&g_link_stats_lock);
+    }
+}
+
+// Account bytes that just moved in one direction. Cheap once the window is over.
+static void link_tune(client_session_t *session, int dir, uint64_t bytes) {
+    pthread_mutex_lock(&session->tune_lock);
+    link_tune_locked(session, dir, bytes);
+    pthread_mutex_unlock(&session->tune_lock);
+}
+
+// Hold the caller back to the connection's and the transfer's rate limits
+static void transfer_pace(client_session_t *session, uint64_t bytes) {
+    rate_pace(&session->rate, bytes);
+    if (session->transfer) {
+        rate_pace(&session->transfer->rate, bytes);
+    }
+}
+
+// Append the chosen values to a STATS reply. Returns the length written.
+static size_t link_format_stats(char *out, size_t out_size) {
+    static const char *names[2] = {"link_rx", "link_tx"};
+    size_t len = 0;
+    pthread_mutex_lock(&g_link_stats_lock);
+    for (int dir = LINK_RX; dir <= LINK_TX && len < out_size; dir++) {
+        link_stats_t *st = &g_link_stats[dir];
+        len += snprintf(out + len, out_size - len,
+                        "%s=links:%llu rtt_us:%u mss:%u mbps:%.1f buf:%d\n",
+                        names[dir], (unsigned long long)st->links, st->rtt_us, st->mss,
+                        st->rate * 8 / 1e6, st->buf);
+    }
+    pthread_mutex_unlock(&g_link_stats_lock);
+    if (len < out_size) {
+#ifdef LINK_MSS
+        len += snprintf(out + len, out_size - len, "link_mss=%d\n", LINK_MSS);
+#else
+        len += snprintf(out + len, out_size - len, "link_mss=auto\n");
+#endif
+    }
+    return len < out_size ? len : out_size - 1;
 }
 
 // Normalize path by removing double slashes
@@ -347,718 +2021,3597 @@ void normalize_path(char *path) {
     *dst = '\0';
 }
 
-// Recursive directory creation
-int mkdir_recursive(const char *path) {
-    char tmp[MAX_PATH];
-    char *p = NULL;
-    size_t len;
+// ============================================================================
+// ADMISSION CONTROL
+// ============================================================================
+// The server decides how many large files upload at once, whatever the
+// client. A file of ADMIT_LARGE_SIZE or more needs a slot: at most
+// ADMIT_MAX_FILES files, and their connections' receive buffers
+// (ADMIT_CONN_BUFFERS each) within ADMIT_BUFFER_BUDGET. Further stripes of
+// an admitted file always get in. Anything else queues: the START_UPLOAD /
+// TRANSFER_JOIN request is kept with its place in line, the client gets a
+// "Queued, position N" progress reply whenever that changes, and the
+// connection rests without a worker or readiness registration. When a slot
+// frees up the connection is scheduled again and the request re-runs. At
+// most ADMIT_MAX_QUEUE uploads wait; past that the server answers busy.
 
-    snprintf(tmp, sizeof(tmp), "%s", path);
-    normalize_path(tmp);  // Remove any double slashes
-    len = strlen(tmp);
-    if (tmp[len - 1] == '/') {
-        tmp[len - 1] = 0;
-    }
+#define ADMIT_LARGE_SIZE RESUME_MIN_SIZE
+#define ADMIT_CONN_BUFFERS ((uint64_t)UPLOAD_PIPELINE_DEPTH * BUFFER_SIZE)
+typedef struct admit_entry {
+    char path[MAX_PATH];
+    uint64_t file_size;
+    int sessions;              // Connections uploading the file
+    struct admit_entry *next;
+} admit_entry_t;
 
-    for (p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            if (mkdir(tmp, 0777) != 0 && errno != EEXIST) {
-                return -1;
-            }
-            chmod(tmp, 0777);
-            *p = '/';
-        }
-    }
-    if (mkdir(tmp, 0777) != 0 && errno != EEXIST) {
-        return -1;
+typedef struct admit_waiter {
+    char path[MAX_PATH];
+    uint64_t file_size;
+    client_session_t *session;
+    uint8_t cmd;               // The request to run again once admitted
+    uint32_t req_id;
+    uint8_t *data;
+    uint32_t data_len;
+    int reported;              // Position last sent to the client
+    bool parked;               // Its worker let go of the connection
+    bool granted;              // Out of the queue, the request may run
+    bool held;                 // The grant took the slot for it
+    int notifying;             // Progress replies being sent outside the lock
+    struct admit_waiter *next;
+} admit_waiter_t;
+
+// Position update collected under g_admit_lock, sent after it is dropped
+typedef struct admit_notice {
+    admit_waiter_t *waiter;
+    int position;
+} admit_notice_t;
+
+static admit_entry_t *g_admitted = NULL;
+static admit_waiter_t *g_admit_queue = NULL;  // FIFO, oldest first
+static int g_admit_queued = 0;
+static int g_admit_files = 0;
+static uint64_t g_admit_buffer_bytes = 0;
+static uint64_t g_admit_prealloc_bytes = 0;   // Sizes of the admitted files
+static uint64_t g_admit_waits = 0;            // Uploads that had to queue
+static uint64_t g_admit_rejects = 0;          // Turned away with the queue full
+static pthread_mutex_t g_admit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_admit_unpinned = PTHREAD_COND_INITIALIZER;  // A waiter's notifying hit 0
+
+static void conn_schedule(client_session_t *session);
+
+// Caller holds g_admit_lock
+static admit_entry_t *admit_find(const char *path) {
+    admit_entry_t *e = g_admitted;
+    while (e && strcmp(e->path, path) != 0) {
+        e = e->next;
     }
-    chmod(tmp, 0777);
-    return 0;
+    return e;
 }
 
-// Global deletion progress counter
-static int g_delete_count = 0;
-static int g_total_files = 0;
-static time_t g_last_notify = 0;
-static int g_client_sock = 0;
+static bool admit_room(void) {
+    return g_admit_files < ADMIT_MAX_FILES &&
+           (g_admit_files == 0 || g_admit_buffer_bytes + ADMIT_CONN_BUFFERS <= ADMIT_BUFFER_BUDGET);
+}
+
+// The peer closed the connection while it was waiting
+static bool admit_client_gone(int sock) {
+    uint8_t byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Count one more connection on path's slot (caller holds g_admit_lock).
+// Returns false if it can't be tracked.
+static bool admit_take_locked(const char *path, uint64_t file_size) {
+    admit_entry_t *entry = admit_find(path);
+    if (!entry) {
+        entry = (admit_entry_t *)calloc(1, sizeof(admit_entry_t));
+        if (!entry) {
+            return false;
+        }
+        snprintf(entry->path, sizeof(entry->path), "%s", path);
+        entry->file_size = file_size;
+        entry->next = g_admitted;
+        g_admitted = entry;
+        g_admit_files++;
+        g_admit_prealloc_bytes += file_size;
+    }
+    entry->sessions++;
+    g_admit_buffer_bytes += ADMIT_CONN_BUFFERS;
+    return true;
+}
+
+static void admit_release_locked(const char *path) {
+    admit_entry_t **ptr = &g_admitted;
+    while (*ptr && strcmp((*ptr)->path, path) != 0) {
+        ptr = &(*ptr)->next;
+    }
+    admit_entry_t *entry = *ptr;
+    if (entry) {
+        g_admit_buffer_bytes -= ADMIT_CONN_BUFFERS;
+        if (--entry->sessions == 0) {
+            *ptr = entry->next;
+            g_admit_files--;
+            g_admit_prealloc_bytes -= entry->file_size;
+            free(entry);
+        }
+    }
+}
+
+// Progress reply to a waiting connection, tagged with its request's id. The
+// waiter is pinned (notifying) so it stays allocated. Only the connection's own
+// worker may wait for its socket; from anywhere else the reply is skipped when
+// the send lock is taken or the socket is full, and sent again with the next
+// change. A reply overtaken by a newer position is dropped. Returns true if
+// the reply went out.
+static bool admit_notify_send(admit_waiter_t *w, int position, bool wait) {
+    client_session_t *session = w->session;
+    char msg[64];
+    uint32_t msg_len = (uint32_t)snprintf(msg, sizeof(msg), "Queued, position %d", position) + 1;
+    uint8_t frame[9 + sizeof(msg)];
+    uint32_t own_id = t_req_id;
+    t_req_id = w->req_id;
+    size_t header_len = response_header(session, frame, RESP_PROGRESS, msg_len);
+    t_req_id = own_id;
+    memcpy(frame + header_len, msg, msg_len);
+    size_t frame_len = header_len + msg_len;
+    
+    if (wait) {
+        pthread_mutex_lock(&session->send_lock);
+    } else if (pthread_mutex_trylock(&session->send_lock) != 0) {
+        return false;
+    }
+    pthread_mutex_lock(&g_admit_lock);
+    bool current = w->reported == position;
+    pthread_mutex_unlock(&g_admit_lock);
+    
+    bool sent = !current;
+    if (current && wait) {
+        sent = output_put(session, NULL, 0, frame, frame_len, true) == 0;
+    } else if (current && session->out_len == 0) {
+        ssize_t n = send(session->sock, frame, frame_len, MSG_DONTWAIT);
+        if (n > 0) {
+            // The rest goes out ahead of the connection's next response
+            memcpy(session->out, frame + n, frame_len - (size_t)n);
+            session->out_len = frame_len - (size_t)n;
+            sent = true;
+        }
+    }
+    pthread_mutex_unlock(&session->send_lock);
+    return sent;
+}
+
+// Send collected position updates, then unpin the waiters and free notices.
+// Only replies to self may wait for the socket. Caller must not hold
+// g_admit_lock.
+static void admit_notify(admit_notice_t *notices, int count, client_session_t *self) {
+    bool *sent = count > 0 ? (bool *)calloc((size_t)count, sizeof(bool)) : NULL;
+    for (int i = 0; i < count && sent; i++) {
+        admit_waiter_t *w = notices[i].waiter;
+        sent[i] = admit_notify_send(w, notices[i].position, w->session == self);
+    }
+    pthread_mutex_lock(&g_admit_lock);
+    for (int i = 0; i < count; i++) {
+        admit_waiter_t *w = notices[i].waiter;
+        if ((!sent || !sent[i]) && w->reported == notices[i].position) {
+            w->reported = 0;  // Report it again with the next change
+        }
+        if (--w->notifying == 0) {
+            pthread_cond_broadcast(&g_admit_unpinned);
+        }
+    }
+    pthread_mutex_unlock(&g_admit_lock);
+    free(sent);
+    free(notices);
+}
+
+// Wait until no progress reply uses w, then free it
+static void admit_waiter_free(admit_waiter_t *w) {
+    pthread_mutex_lock(&g_admit_lock);
+    while (w->notifying > 0) {
+        pthread_cond_wait(&g_admit_unpinned, &g_admit_lock);
+    }
+    pthread_mutex_unlock(&g_admit_lock);
+    free(w->data);
+    free(w);
+}
+
+// Hand out what room there is in queue order - a later waiter for a file
+// that is already admitted goes in at once - and collect a position update
+// for the rest into *notices (pass them to admit_notify once the lock is
+// dropped). Granted connections that rest are scheduled again, so are
+// resting ones whose client left, to be closed.
+// Caller holds g_admit_lock. Returns the number of notices.
+static int admit_advance_locked(admit_notice_t **notices) {
+    admit_waiter_t **ptr = &g_admit_queue;
+    bool blocked = false;  // An earlier waiter still needs room
+    while (*ptr) {
+        admit_waiter_t *w = *ptr;
+        if (w->parked && admit_client_gone(w->session->sock)) {
+            // Left while waiting - close it without spending a slot
+            *ptr = w->next;
+            g_admit_queued--;
+            w->granted = true;
+            w->session->closing = true;
+            conn_schedule(w->session);
+            continue;
+        }
+        if (!admit_find(w->path) && (blocked || !admit_room())) {
+            blocked = true;
+            ptr = &w->next;
+            continue;
+        }
+        *ptr = w->next;
+        g_admit_queued--;
+        w->held = admit_take_locked(w->path, w->file_size);
+        w->granted = true;
+        if (w->parked) {
+            conn_schedule(w->session);
+        }
+    }
+    
+    *notices = NULL;
+    int count = 0;
+    int position = 1;
+    for (admit_waiter_t *w = g_admit_queue; w; w = w->next, position++) {
+        if (w->reported == position) {
+            continue;
+        }
+        if (!*notices) {
+            *notices = (admit_notice_t *)malloc((size_t)g_admit_queued * sizeof(admit_notice_t));
+            if (!*notices) {
+                break;  // Positions go out with the next change
+            }
+        }
+        w->reported = position;
+        w->notifying++;
+        (*notices)[count].waiter = w;
+        (*notices)[count].position = position;
+        count++;
+    }
+    return count;
+}
+
+// Take an upload slot for path. Returns 1 once admitted (release with
+// admit_release), 0 if the file is small enough not to need a slot, -1 if
+// the request was queued (cmd and data are kept to run it again later) or
+// turned away - the reply is sent either way.
+static int admit_acquire(client_session_t *session, const char *path, uint64_t file_size,
+                         uint8_t cmd, const uint8_t *data, uint32_t data_len) {
+    if (file_size < ADMIT_LARGE_SIZE) {
+        return 0;
+    }
+    if (session->admit_granted) {
+        // Re-run of a queued request - the slot was taken when it was granted
+        session->admit_granted = false;
+        return 1;
+    }
+    
+    pthread_mutex_lock(&g_admit_lock);
+    if (admit_find(path) || (!g_admit_queue && admit_room())) {
+        // Can't track it - let it through rather than fail the upload
+        int admitted = admit_take_locked(path, file_size) ? 1 : 0;
+        pthread_mutex_unlock(&g_admit_lock);
+        return admitted;
+    }
+    
+    const char *error = NULL;
+    admit_waiter_t *w = NULL;
+    if (g_admit_queued >= ADMIT_MAX_QUEUE) {
+        g_admit_rejects++;
+        error = "Server busy, retry later";
+    } else {
+        w = (admit_waiter_t *)calloc(1, sizeof(admit_waiter_t));
+        uint8_t *copy = w ? (uint8_t *)malloc(data_len ? data_len : 1) : NULL;
+        if (!copy) {
+            free(w);
+            w = NULL;
+            error = "Out of memory";
+        } else {
+            memcpy(copy, data, data_len);
+            snprintf(w->path, sizeof(w->path), "%s", path);
+            w->file_size = file_size;
+            w->session = session;
+            w->cmd = cmd;
+            w->req_id = t_req_id;
+            w->data = copy;
+            w->data_len = data_len;
+        }
+    }
+    if (!w) {
+        pthread_mutex_unlock(&g_admit_lock);
+        send_error(session, error);
+        return -1;
+    }
+    
+    admit_waiter_t **tail = &g_admit_queue;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = w;
+    g_admit_queued++;
+    g_admit_waits++;
+    session->admit_wait = w;
+    admit_notice_t *notice = (admit_notice_t *)malloc(sizeof(admit_notice_t));
+    if (notice) {
+        notice->waiter = w;
+        notice->position = g_admit_queued;
+        w->reported = g_admit_queued;
+        w->notifying++;
+    }
+    pthread_mutex_unlock(&g_admit_lock);
+    admit_notify(notice, notice ? 1 : 0, session);
+    return -1;
+}
+
+static void admit_release(const char *path) {
+    admit_notice_t *notices;
+    pthread_mutex_lock(&g_admit_lock);
+    admit_release_locked(path);
+    int count = admit_advance_locked(&notices);
+    pthread_mutex_unlock(&g_admit_lock);
+    admit_notify(notices, count, NULL);
+}
+
+// Called by the connection's worker once the command that queued has
+// returned. Returns true if the connection now rests in line and the worker
+// must let go of it, false if the grant came through already.
+static bool admit_park(client_session_t *session) {
+    pthread_mutex_lock(&g_admit_lock);
+    admit_waiter_t *w = session->admit_wait;
+    bool park = !w->granted;
+    if (park) {
+        w->parked = true;
+    }
+    pthread_mutex_unlock(&g_admit_lock);
+    return park;
+}
+
+// Drop the connection's place in line, or the slot granted to it
+static void admit_cancel(client_session_t *session) {
+    admit_waiter_t *w = session->admit_wait;
+    if (!w) {
+        return;
+    }
+    session->admit_wait = NULL;
+    
+    pthread_mutex_lock(&g_admit_lock);
+    if (!w->granted) {
+        admit_waiter_t **ptr = &g_admit_queue;
+        while (*ptr != w) {
+            ptr = &(*ptr)->next;
+        }
+        *ptr = w->next;
+        g_admit_queued--;
+    } else if (w->held) {
+        admit_release_locked(w->path);
+    }
+    admit_notice_t *notices;
+    int count = admit_advance_locked(&notices);
+    pthread_mutex_unlock(&g_admit_lock);
+    admit_notify(notices, count, NULL);
+    admit_waiter_free(w);
+}
+
+// Append admission state to a STATS reply. Returns the length written.
+static size_t admit_format_stats(char *out, size_t out_size) {
+    pthread_mutex_lock(&g_admit_lock);
+    int len = snprintf(out, out_size,
+                       "admit_files=active:%d max:%d queued:%d waits:%llu rejects:%llu\n"
+                       "admit_buffers=bytes:%llu budget:%llu\n"
+                       "admit_prealloc_bytes=%llu\n",
+                       g_admit_files, ADMIT_MAX_FILES, g_admit_queued, (unsigned long long)g_admit_waits,
+                       (unsigned long long)g_admit_rejects,
+                       (unsigned long long)g_admit_buffer_bytes, (unsigned long long)ADMIT_BUFFER_BUDGET,
+                       (unsigned long long)g_admit_prealloc_bytes);
+    pthread_mutex_unlock(&g_admit_lock);
+    if (len < 0) return 0;
+    return (size_t)len < out_size ? (size_t)len : out_size - 1;
+}
+
+// ============================================================================
+// DIRECTORY TRAVERSAL
+// ============================================================================
+// Walkers work relative to the fd of the directory being read (openat,
+// fstatat, unlinkat), so the kernel resolves one component per entry instead
+// of re-walking the whole path, and trust d_type to tell directories apart
+// without a stat wherever the filesystem fills it in.
+
+// Open name relative to the directory fd at (AT_FDCWD for a plain path)
+static DIR *dir_open_at(int at, const char *name) {
+    int fd = openat(at, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+    }
+    return dir;
+}
+
+// Classify entry name of the directory open at fd, given its d_type.
+// Returns 1 for a directory, 0 for anything else, -1 if it can't be
+// examined (e.g. removed meanwhile). With st set, non-directories are always
+// stat'ed so the caller gets size and mtime; directories only are when
+// d_type can't answer. follow resolves symlinks - walkers that modify the
+// tree must not.
+static int dir_kind_at(int fd, const char *name, unsigned char d_type, struct stat *st, bool follow) {
+    if (d_type == DT_DIR) {
+        return 1;
+    }
+    bool known = d_type != DT_UNKNOWN && !(follow && d_type == DT_LNK);
+    if (known && !st) {
+        return 0;
+    }
+    struct stat local;
+    if (fstatat(fd, name, st ? st : &local, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+        return -1;
+    }
+    return S_ISDIR((st ? st : &local)->st_mode) ? 1 : 0;
+}
+
+// dir_kind_at() for a readdir() entry of dir
+static int dir_entry_kind(DIR *dir, const struct dirent *entry, struct stat *st, bool follow) {
+    return dir_kind_at(dirfd(dir), entry->d_name, entry->d_type, st, follow);
+}
+
+// ============================================================================
+// PARALLEL STAT
+// ============================================================================
+// Large listings collect their names in one readdir() pass, then resolve
+// type, size and mtime here. Past LIST_STAT_THRESHOLD entries the fstatat()
+// calls are spread over a small pool in LIST_STAT_BATCH slices - metadata
+// lookups on the internal SSD and on exFAT USB drives overlap well. The
+// caller works on its own job too, so a busy pool never stalls a listing.
+
+#ifndef LIST_STAT_THREADS
+#define LIST_STAT_THREADS 4
+#endif
+#ifndef LIST_STAT_THRESHOLD
+#define LIST_STAT_THRESHOLD 1024
+#endif
+#define LIST_STAT_BATCH 64
+
+typedef struct {
+    uint32_t name_off;  // Into the batch's name arena
+    uint16_t name_len;
+    uint8_t d_type;
+    uint8_t type;       // Resolved: 1 = directory
+    uint64_t size;
+    uint64_t mtime;
+} stat_item_t;
+
+typedef struct stat_job {
+    struct stat_job *next;
+    int dir_fd;
+    const char *names;
+    stat_item_t *items;
+    size_t count;
+    size_t claimed;
+    size_t finished;
+    pthread_cond_t done;
+} stat_job_t;
+
+static stat_job_t *g_stat_jobs = NULL;  // Jobs with unclaimed items
+static bool g_stat_started = false;
+static pthread_mutex_t g_stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_stat_ready = PTHREAD_COND_INITIALIZER;
+
+static void stat_item_resolve(int dir_fd, const char *names, stat_item_t *item) {
+    struct stat st;
+    int kind = dir_kind_at(dir_fd, names + item->name_off, item->d_type, &st, true);
+    item->type = kind == 1 ? 1 : 0;
+    item->size = kind == 0 ? (uint64_t)st.st_size : 0;
+    item->mtime = kind == 0 ? (uint64_t)st.st_mtime : 0;
+}
+
+// Take the next slice of job. Returns its length, 0 once all are handed out.
+static size_t stat_job_claim_locked(stat_job_t *job, size_t *start) {
+    if (job->claimed >= job->count) {
+        return 0;
+    }
+    size_t n = job->count - job->claimed;
+    if (n > LIST_STAT_BATCH) {
+        n = LIST_STAT_BATCH;
+    }
+    *start = job->claimed;
+    job->claimed += n;
+    if (job->claimed == job->count) {
+        for (stat_job_t **ptr = &g_stat_jobs; *ptr; ptr = &(*ptr)->next) {
+            if (*ptr == job) {
+                *ptr = job->next;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+// Resolve a claimed slice, then count it done. Called and returns with
+// g_stat_lock held.
+static void stat_job_run_locked(stat_job_t *job, size_t start, size_t n) {
+    pthread_mutex_unlock(&g_stat_lock);
+    for (size_t i = start; i < start + n; i++) {
+        stat_item_resolve(job->dir_fd, job->names, &job->items[i]);
+    }
+    pthread_mutex_lock(&g_stat_lock);
+    job->finished += n;
+    if (job->finished == job->count) {
+        pthread_cond_signal(&job->done);
+    }
+}
+
+static void *stat_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_stat_lock);
+    while (1) {
+        while (!g_stat_jobs) {
+            pthread_cond_wait(&g_stat_ready, &g_stat_lock);
+        }
+        stat_job_t *job = g_stat_jobs;
+        size_t start;
+        size_t n = stat_job_claim_locked(job, &start);
+        if (n > 0) {
+            stat_job_run_locked(job, start, n);
+        }
+    }
+    return NULL;
+}
+
+static void stat_pool_init(void) {
+    for (int i = 0; i < LIST_STAT_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stat_worker, NULL) == 0) {
+            pthread_detach(thread);
+            g_stat_started = true;
+        }
+    }
+}
+
+// Resolve every item of a listing of the directory open at dir_fd
+static void stat_items(int dir_fd, const char *names, stat_item_t *items, size_t count) {
+    if (count < LIST_STAT_THRESHOLD || !g_stat_started) {
+        for (size_t i = 0; i < count; i++) {
+            stat_item_resolve(dir_fd, names, &items[i]);
+        }
+        return;
+    }
+    
+    stat_job_t job = {
+        .next = NULL, .dir_fd = dir_fd, .names = names, .items = items, .count = count,
+    };
+    pthread_cond_init(&job.done, NULL);
+    
+    pthread_mutex_lock(&g_stat_lock);
+    stat_job_t **tail = &g_stat_jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = &job;
+    pthread_cond_broadcast(&g_stat_ready);
+    
+    size_t start, n;
+    while ((n = stat_job_claim_locked(&job, &start)) > 0) {
+        stat_job_run_locked(&job, start, n);
+    }
+    while (job.finished < job.count) {
+        pthread_cond_wait(&job.done, &g_stat_lock);
+    }
+    pthread_mutex_unlock(&g_stat_lock);
+    pthread_cond_destroy(&job.done);
+}
+
+// ============================================================================
+// DIRECTORY CACHE
+// ============================================================================
+// Remembers directories known to exist so mkdir_recursive doesn't re-issue
+// mkdir()+chmod() for every component of every upload. Keys are normalized
+// paths without a trailing slash. Anything that removes or moves a directory
+// must call dir_cache_invalidate().
+
+#define DIR_CACHE_BUCKETS 4096
+#define DIR_CACHE_MAX_ENTRIES 16384
+
+typedef struct dir_cache_entry {
+    uint32_t hash;
+    struct dir_cache_entry *next;
+    char path[];
+} dir_cache_entry_t;
+
+static dir_cache_entry_t *g_dir_cache[DIR_CACHE_BUCKETS];
+static int g_dir_cache_count = 0;
+static pthread_mutex_t g_dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t path_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Is the first len bytes of path a known directory?
+bool dir_cache_contains(const char *path, size_t len) {
+    uint32_t h = path_hash(path, len);
+    bool found = false;
+    
+    pthread_mutex_lock(&g_dir_cache_lock);
+    for (dir_cache_entry_t *e = g_dir_cache[h % DIR_CACHE_BUCKETS]; e; e = e->next) {
+        if (e->hash == h && strncmp(e->path, path, len) == 0 && e->path[len] == '\0') {
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_dir_cache_lock);
+    return found;
+}
+
+static void dir_cache_clear_locked() {
+    for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        dir_cache_entry_t *e = g_dir_cache[i];
+        while (e) {
+            dir_cache_entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+        g_dir_cache[i] = NULL;
+    }
+    g_dir_cache_count = 0;
+}
+
+void dir_cache_add(const char *path, size_t len) {
+    if (dir_cache_contains(path, len)) return;
+    
+    dir_cache_entry_t *e = (dir_cache_entry_t *)malloc(sizeof(dir_cache_entry_t) + len + 1);
+    if (!e) return;
+    memcpy(e->path, path, len);
+    e->path[len] = '\0';
+    e->hash = path_hash(path, len);
+    
+    pthread_mutex_lock(&g_dir_cache_lock);
+    if (g_dir_cache_count >= DIR_CACHE_MAX_ENTRIES) {
+        // Bounded memory - start over rather than track LRU order
+        dir_cache_clear_locked();
+    }
+    e->next = g_dir_cache[e->hash % DIR_CACHE_BUCKETS];
+    g_dir_cache[e->hash % DIR_CACHE_BUCKETS] = e;
+    g_dir_cache_count++;
+    pthread_mutex_unlock(&g_dir_cache_lock);
+}
+
+// Forget a directory and everything below it (after delete/rename/move)
+void dir_cache_invalidate(const char *path) {
+    char key[MAX_PATH];
+    snprintf(key, sizeof(key), "%s", path);
+    normalize_path(key);
+    size_t len = strlen(key);
+    if (len > 1 && key[len - 1] == '/') {
+        key[--len] = '\0';
+    }
+    
+    pthread_mutex_lock(&g_dir_cache_lock);
+    for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        dir_cache_entry_t **ptr = &g_dir_cache[i];
+        while (*ptr) {
+            dir_cache_entry_t *e = *ptr;
+            if (strncmp(e->path, key, len) == 0 && (e->path[len] == '\0' || e->path[len] == '/')) {
+                *ptr = e->next;
+                free(e);
+                g_dir_cache_count--;
+            } else {
+                ptr = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_dir_cache_lock);
+}
+
+// Recursive directory creation - skips every prefix already known to exist
+int mkdir_recursive(const char *path) {
+    char tmp[MAX_PATH];
+    size_t len;
+
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    normalize_path(tmp);  // Remove any double slashes
+    len = strlen(tmp);
+    if (len == 0) {
+        return -1;
+    }
+    if (len > 1 && tmp[len - 1] == '/') {
+        tmp[--len] = 0;
+    }
+    
+    // Fast path: whole tree already exists
+    if (dir_cache_contains(tmp, len)) {
+        return 0;
+    }
+    
+    // Find the deepest cached ancestor and only create what's below it
+    char *start = tmp + 1;
+    for (char *p = tmp + len - 1; p > tmp; p--) {
+        if (*p == '/' && dir_cache_contains(tmp, (size_t)(p - tmp))) {
+            start = p + 1;
+            break;
+        }
+    }
+
+    for (char *p = start; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char saved = *p;
+            *p = 0;
+            if (mkdir(tmp, 0777) == 0) {
+                chmod(tmp, 0777);  // Only new directories - umask may have masked bits
+            } else if (errno != EEXIST) {
+                return -1;
+            }
+            dir_cache_add(tmp, (size_t)(p - tmp));
+            *p = saved;
+            if (saved == '\0') {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// ============================================================================
+// LISTING CACHE
+// ============================================================================
+// Keeps encoded LIST_DIR replies so browsing back and forth through big
+// folders doesn't re-read and re-stat them. An entry is served only while
+// the directory's inode and mtime still match; handlers that change a file
+// without touching its directory's mtime (upload, overwrite, copy, touch)
+// must call list_cache_invalidate(). Directories modified in the last
+// LIST_CACHE_RACY_SECS aren't cached - on filesystems with coarse
+// timestamps (exFAT) a change could land in the same mtime tick.
+
+#ifndef LIST_CACHE_MAX_ENTRIES
+#define LIST_CACHE_MAX_ENTRIES 64
+#endif
+#ifndef LIST_CACHE_MAX_BYTES
+#define LIST_CACHE_MAX_BYTES (8 * 1024 * 1024)
+#endif
+#define LIST_CACHE_TTL_SECS 30  // Bounds staleness from writers outside the server
+#define LIST_CACHE_RACY_SECS 2
+
+typedef struct list_cache_entry {
+    struct list_cache_entry *prev, *next;  // LRU order, most recent first
+    uint32_t hash;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t cached_at;
+    uint8_t *data;
+    uint32_t len;
+    char path[];
+} list_cache_entry_t;
+
+static list_cache_entry_t *g_list_cache_head = NULL;
+static list_cache_entry_t *g_list_cache_tail = NULL;
+static int g_list_cache_count = 0;
+static size_t g_list_cache_bytes = 0;
+static uint64_t g_list_cache_gen = 0;  // Bumped by every invalidation
+static uint64_t g_list_cache_hits = 0;
+static uint64_t g_list_cache_misses = 0;
+static pthread_mutex_t g_list_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Normalized path without a trailing slash, as for the directory cache
+static size_t list_cache_key(char *key, size_t key_size, const char *path) {
+    snprintf(key, key_size, "%s", path);
+    normalize_path(key);
+    size_t len = strlen(key);
+    if (len > 1 && key[len - 1] == '/') {
+        key[--len] = '\0';
+    }
+    return len;
+}
+
+static void list_cache_unlink_locked(list_cache_entry_t *e) {
+    if (e->prev) e->prev->next = e->next;
+    else g_list_cache_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else g_list_cache_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void list_cache_drop_locked(list_cache_entry_t *e) {
+    list_cache_unlink_locked(e);
+    g_list_cache_count--;
+    g_list_cache_bytes -= e->len;
+    free(e->data);
+    free(e);
+}
+
+static list_cache_entry_t *list_cache_find_locked(const char *key) {
+    uint32_t h = path_hash(key, strlen(key));
+    for (list_cache_entry_t *e = g_list_cache_head; e; e = e->next) {
+        if (e->hash == h && strcmp(e->path, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static bool list_cache_fresh(const list_cache_entry_t *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+           time(NULL) - e->cached_at < LIST_CACHE_TTL_SECS;
+}
+
+// Send the cached reply for key if it is still valid for the directory
+// described by st. Returns false on a miss; *gen is then the generation to
+// hand to list_cache_store().
+static bool list_cache_send(client_session_t *session, const char *key, const struct stat *st, uint64_t *gen) {
+    pthread_mutex_lock(&g_list_cache_lock);
+    *gen = g_list_cache_gen;
+    list_cache_entry_t *e = list_cache_find_locked(key);
+    if (e && !list_cache_fresh(e, st)) {
+        list_cache_drop_locked(e);
+        e = NULL;
+    }
+    uint8_t *copy = NULL;
+    uint32_t len = 0;
+    if (e) {
+        // Copy out so the send doesn't hold the lock. Never wait for the
+        // pool here - a busy pool just makes this a miss.
+        copy = pool_try_acquire(e->len, e->len, NULL);
+    }
+    if (copy) {
+        len = e->len;
+        memcpy(copy, e->data, len);
+        list_cache_unlink_locked(e);
+        e->next = g_list_cache_head;
+        if (g_list_cache_head) g_list_cache_head->prev = e;
+        g_list_cache_head = e;
+        if (!g_list_cache_tail) g_list_cache_tail = e;
+        g_list_cache_hits++;
+    } else {
+        g_list_cache_misses++;
+    }
+    pthread_mutex_unlock(&g_list_cache_lock);
+    
+    if (!copy) {
+        return false;
+    }
+    send_response(session, RESP_DATA, copy, len);
+    pool_release(copy);
+    return true;
+}
+
+// Remember a freshly built reply. Skipped if anything was invalidated since
+// gen was taken - the listing may have been read before that change.
+static void list_cache_store(const char *key, const struct stat *st, uint64_t gen,
+                             const uint8_t *data, uint32_t len) {
+    if (len > LIST_CACHE_MAX_BYTES / 4 || time(NULL) - st->st_mtim.tv_sec < LIST_CACHE_RACY_SECS) {
+        return;
+    }
+    size_t key_len = strlen(key);
+    list_cache_entry_t *e = (list_cache_entry_t *)malloc(sizeof(list_cache_entry_t) + key_len + 1);
+    uint8_t *copy = (uint8_t *)malloc(len);
+    if (!e || !copy) {
+        free(e);
+        free(copy);
+        return;
+    }
+    memcpy(e->path, key, key_len + 1);
+    memcpy(copy, data, len);
+    e->hash = path_hash(key, key_len);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->mtime = st->st_mtim;
+    e->cached_at = time(NULL);
+    e->data = copy;
+    e->len = len;
+    e->prev = NULL;
+    
+    pthread_mutex_lock(&g_list_cache_lock);
+    if (gen != g_list_cache_gen) {
+        pthread_mutex_unlock(&g_list_cache_lock);
+        free(copy);
+        free(e);
+        return;
+    }
+    list_cache_entry_t *old = list_cache_find_locked(key);
+    if (old) {
+        list_cache_drop_locked(old);
+    }
+    while (g_list_cache_tail &&
+           (g_list_cache_count >= LIST_CACHE_MAX_ENTRIES || g_list_cache_bytes + len > LIST_CACHE_MAX_BYTES)) {
+        list_cache_drop_locked(g_list_cache_tail);
+    }
+    e->next = g_list_cache_head;
+    if (g_list_cache_head) g_list_cache_head->prev = e;
+    g_list_cache_head = e;
+    if (!g_list_cache_tail) g_list_cache_tail = e;
+    g_list_cache_count++;
+    g_list_cache_bytes += len;
+    pthread_mutex_unlock(&g_list_cache_lock);
+}
+
+// Forget the listings that show path: its parent's, its own and, for a
+// directory, everything below it
+void list_cache_invalidate(const char *path) {
+    char key[MAX_PATH];
+    size_t len = list_cache_key(key, sizeof(key), path);
+    if (len == 0) {
+        return;
+    }
+    char *slash = strrchr(key, '/');
+    size_t parent_len = slash ? (slash == key ? 1 : (size_t)(slash - key)) : 0;
+    
+    pthread_mutex_lock(&g_list_cache_lock);
+    g_list_cache_gen++;
+    list_cache_entry_t *e = g_list_cache_head;
+    while (e) {
+        list_cache_entry_t *next = e->next;
+        bool below = strncmp(e->path, key, len) == 0 &&
+                     (e->path[len] == '\0' || e->path[len] == '/' || (len == 1 && key[0] == '/'));
+        bool parent = parent_len && strncmp(e->path, key, parent_len) == 0 && e->path[parent_len] == '\0';
+        if (below || parent) {
+            list_cache_drop_locked(e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&g_list_cache_lock);
+}
+
+static size_t list_cache_format_stats(char *out, size_t out_size) {
+    pthread_mutex_lock(&g_list_cache_lock);
+    int len = snprintf(out, out_size, "list_cache=entries:%d bytes:%llu hits:%llu misses:%llu\n",
+                       g_list_cache_count, (unsigned long long)g_list_cache_bytes,
+                       (unsigned long long)g_list_cache_hits, (unsigned long long)g_list_cache_misses);
+    pthread_mutex_unlock(&g_list_cache_lock);
+    if (len < 0) return 0;
+    return (size_t)len < out_size ? (size_t)len : out_size - 1;
+}
+
+// Global deletion progress counter
+static int g_delete_count = 0;
+static int g_total_files = 0;
+static time_t g_last_notify = 0;
+static int g_client_sock = 0;
 
 // Forward declaration
 void send_progress_message(const char *msg);
 
-// Global scan counter for progress updates (reset before each scan)
-static int g_scan_count = 0;
-static time_t g_last_scan_notify = 0;
+// Global scan counter for progress updates (reset before each scan)
+static int g_scan_count = 0;
+static time_t g_last_scan_notify = 0;
+
+// Count files in directory recursively with progress updates
+static int count_files_at(int at, const char *name) {
+    DIR *dir = dir_open_at(at, name);
+    if (!dir) {
+        return 0;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        int kind = dir_entry_kind(dir, entry, NULL, false);
+        if (kind < 0) {
+            continue;
+        }
+        if (kind == 1) {
+            count++;  // Count the directory itself
+            count += count_files_at(dirfd(dir), entry->d_name);  // Count its contents
+        } else {
+            count++;
+            g_scan_count++;
+            
+            // Send progress every 500 files or every 3 seconds during counting
+            time_t now = time(NULL);
+            if (g_scan_count % 500 == 0 || (now - g_last_scan_notify) >= 3) {
+                char msg[256];
+                snprintf(msg, sizeof(msg), "📊 Scanning... found %d files so far", g_scan_count);
+                send_progress_message(msg);
+                g_last_scan_notify = now;
+            }
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+int count_files_recursive(const char *path) {
+    return count_files_at(AT_FDCWD, path);
+}
+
+// With FEATURE_MUX a delete runs on its request's thread and reports through
+// the session, tagged with the request id, instead of through g_client_sock
+static __thread client_session_t *t_progress_session = NULL;
+
+// Send progress message to client
+void send_progress_message(const char *msg) {
+    if (t_progress_session) {
+        send_response(t_progress_session, RESP_PROGRESS, msg, strlen(msg) + 1);
+    } else if (g_client_sock > 0) {
+        uint8_t header[5];
+        header[0] = RESP_PROGRESS;
+        uint32_t len = strlen(msg) + 1;
+        memcpy(header + 1, &len, 4);
+        struct iovec iov[2] = {
+            { .iov_base = header, .iov_len = 5 },
+            { .iov_base = (void *)msg, .iov_len = len },
+        };
+        writev_full(g_client_sock, iov, 2);
+    }
+}
+
+// Recursive directory deletion with progress reporting. Symlinks are
+// removed, never followed.
+static int rmdir_at(int at, const char *name) {
+    DIR *dir = dir_open_at(at, name);
+    if (!dir) {
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        int kind = dir_entry_kind(dir, entry, NULL, false);
+        if (kind < 0) {
+            continue;
+        }
+        if (kind == 1) {
+            rmdir_at(dirfd(dir), entry->d_name);
+        } else {
+            unlinkat(dirfd(dir), entry->d_name, 0);
+            g_delete_count++;
+            
+            // Send progress every 50 files or every 2 seconds
+            time_t now = time(NULL);
+            if (g_delete_count % 50 == 0 || (now - g_last_notify) >= 2) {
+                int percentage = (g_total_files > 0) ? (g_delete_count * 100 / g_total_files) : 0;
+                char msg[256];
+                snprintf(msg, sizeof(msg), "🗑️ Deleting... %d/%d files (%d%%)", 
+                         g_delete_count, g_total_files, percentage);
+                send_progress_message(msg);
+                g_last_notify = now;
+            }
+        }
+    }
+    closedir(dir);
+    return unlinkat(at, name, AT_REMOVEDIR);
+}
+
+int rmdir_recursive(const char *path) {
+    return rmdir_at(AT_FDCWD, path);
+}
+
+// Handle PING
+void handle_ping(client_session_t *session) {
+    send_ok(session, "PONG");
+}
+
+// REMOVED: handle_list_storage() - No longer show disk space to avoid privacy concerns
+
+// Handle HELLO - negotiate optional features for this connection
+// Payload: requested features(4)
+// Reply RESP_DATA: protocol_version(4) + accepted features(4)
+// The reply still uses the framing the request came in; the new features
+// apply from the next request. FEATURE_MUX can't be turned off again while
+// other requests may be in flight.
+void handle_hello(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    uint32_t requested = 0;
+    if (data_len >= 4) {
+        memcpy(&requested, data, 4);
+    }
+    uint32_t accepted = (requested & FEATURES_SUPPORTED) | (session->features & FEATURE_MUX);
+    
+    uint8_t reply[8];
+    uint32_t version = PROTOCOL_VERSION;
+    memcpy(reply, &version, 4);
+    memcpy(reply + 4, &accepted, 4);
+    send_response(session, RESP_DATA, reply, sizeof(reply));
+    session->features = accepted;
+}
+
+// Listing entry on the wire: type(1) + name_len(2) + name + size(8) + mtime(8)
+#define LIST_ENTRY_SIZE(name_len) (1 + 2 + (size_t)(name_len) + 8 + 8)
+
+// Names read from a directory, waiting for stat_items() and encoding
+typedef struct {
+    stat_item_t *items;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    size_t bytes;  // Encoded size of the items
+} list_batch_t;
+
+static bool list_batch_add(list_batch_t *batch, const struct dirent *entry) {
+    size_t name_len = strlen(entry->d_name);
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity ? batch->capacity * 2 : 256;
+        stat_item_t *items = realloc(batch->items, capacity * sizeof(stat_item_t));
+        if (!items) return false;
+        batch->items = items;
+        batch->capacity = capacity;
+    }
+    if (batch->names_len + name_len + 1 > batch->names_capacity) {
+        size_t capacity = batch->names_capacity ? batch->names_capacity : 8192;
+        while (capacity < batch->names_len + name_len + 1) {
+            capacity *= 2;
+        }
+        char *names = realloc(batch->names, capacity);
+        if (!names) return false;
+        batch->names = names;
+        batch->names_capacity = capacity;
+    }
+    
+    // NUL-terminated for fstatat()
+    stat_item_t *item = &batch->items[batch->count++];
+    item->name_off = (uint32_t)batch->names_len;
+    item->name_len = (uint16_t)name_len;
+    item->d_type = entry->d_type;
+    memcpy(batch->names + batch->names_len, entry->d_name, name_len + 1);
+    batch->names_len += name_len + 1;
+    batch->bytes += LIST_ENTRY_SIZE(name_len);
+    return true;
+}
+
+static void list_batch_reset(list_batch_t *batch) {
+    batch->count = 0;
+    batch->names_len = 0;
+    batch->bytes = 0;
+}
+
+static void list_batch_free(list_batch_t *batch) {
+    free(batch->items);
+    free(batch->names);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Encode the resolved items in readdir() order. out holds batch->bytes.
+static void list_batch_encode(const list_batch_t *batch, uint8_t *out) {
+    for (size_t i = 0; i < batch->count; i++) {
+        const stat_item_t *item = &batch->items[i];
+        *out++ = item->type;
+        memcpy(out, &item->name_len, 2);
+        out += 2;
+        memcpy(out, batch->names + item->name_off, item->name_len);
+        out += item->name_len;
+        memcpy(out, &item->size, 8);
+        out += 8;
+        memcpy(out, &item->mtime, 8);
+        out += 8;
+    }
+}
+
+static bool list_skip_entry(const struct dirent *entry) {
+    return strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0;
+}
+
+// Handle LIST_DIR - Optimized version using d_type only (no stat for dirs)
+// Reply RESP_DATA: count(4) + entries, in one frame of up to BUFFER_SIZE.
+// A directory that doesn't fit gets an error naming LIST_DIR_PAGED rather
+// than a silently partial listing. Names are read
+// first and stat'ed together so big directories fan out over the stat pool.
+// Replies are kept in the listing cache.
+void handle_list_dir(client_session_t *session, const char *path) {
+    char norm_path[MAX_PATH];
+    list_cache_key(norm_path, sizeof(norm_path), path);
+    
+    // A single stat() decides whether the cached reply still holds
+    struct stat dir_st;
+    uint64_t gen = 0;
+    bool cacheable = stat(norm_path, &dir_st) == 0 && S_ISDIR(dir_st.st_mode);
+    if (cacheable && list_cache_send(session, norm_path, &dir_st, &gen)) {
+        return;
+    }
+    
+    int32_t entry_count = 0;
+    DIR *dir = opendir(norm_path);
+    if (!dir) {
+        send_response(session, RESP_DATA, &entry_count, 4);
+        return;
+    }
+    
+    list_batch_t batch = {0};
+    const char *failure = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (list_skip_entry(entry)) {
+            continue;
+        }
+        if (4 + batch.bytes + LIST_ENTRY_SIZE(strlen(entry->d_name)) > BUFFER_SIZE) {
+            failure = "Directory too large, use LIST_DIR_PAGED";
+            break;
+        }
+        if (!list_batch_add(&batch, entry)) {
+            failure = "Out of memory";
+            break;
+        }
+    }
+    if (failure) {
+        closedir(dir);
+        list_batch_free(&batch);
+        send_error(session, failure);
+        return;
+    }
+    stat_items(dirfd(dir), batch.names, batch.items, batch.count);
+    closedir(dir);
+    
+    size_t used = 4 + batch.bytes;
+    uint8_t *buffer = pool_acquire(used, used, NULL);
+    if (!buffer) {
+        list_batch_free(&batch);
+        send_response(session, RESP_DATA, &entry_count, 4);
+        return;
+    }
+    entry_count = (int32_t)batch.count;
+    memcpy(buffer, &entry_count, 4);
+    list_batch_encode(&batch, buffer + 4);
+    list_batch_free(&batch);
+    
+    send_response(session, RESP_DATA, buffer, (uint32_t)used);
+    if (cacheable) {
+        list_cache_store(norm_path, &dir_st, gen, buffer, (uint32_t)used);
+    }
+    pool_release(buffer);
+}
+
+// Handle LIST_DIR_PAGED
+// Payload: path + '\0' + cursor(8) + limit(4)
+// Streams RESP_DATA frames as readdir() produces entries, each
+// flags(1) + cursor(8) + count(4) + entries (encoded as for LIST_DIR).
+// cursor is the position after the frame's last entry - passing it back
+// continues the listing from there. LIST_FLAG_LAST marks the final frame of
+// this reply, LIST_FLAG_END that the directory has no entries left.
+// limit 0 lists everything from cursor on.
+#define LIST_FRAME_SIZE (64 * 1024)
+#define LIST_FLAG_LAST 0x01
+#define LIST_FLAG_END 0x02
+
+void handle_list_dir_paged(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *path = (const char *)data;
+    uint32_t path_len = strnlen(path, data_len);
+    if (path_len + 13 > data_len) {
+        send_error(session, "Invalid list request");
+        return;
+    }
+    uint64_t cursor;
+    uint32_t limit;
+    memcpy(&cursor, data + path_len + 1, 8);
+    memcpy(&limit, data + path_len + 9, 4);
+    
+    char norm_path[MAX_PATH];
+    snprintf(norm_path, sizeof(norm_path), "%s", path);
+    normalize_path(norm_path);
+    
+    DIR *dir = opendir(norm_path);
+    if (!dir) {
+        send_error(session, "Cannot open directory");
+        return;
+    }
+    uint8_t *frame = pool_acquire(LIST_FRAME_SIZE, LIST_FRAME_SIZE, NULL);
+    if (!frame) {
+        closedir(dir);
+        send_error(session, "Out of memory");
+        return;
+    }
+    
+    // The cursor counts entries in readdir() order, which is stable while
+    // the directory is unchanged
+    uint64_t position = 0;
+    uint32_t listed = 0;
+    struct dirent *entry;
+    while (position < cursor && (entry = readdir(dir)) != NULL) {
+        if (!list_skip_entry(entry)) {
+            position++;
+        }
+    }
+    
+    // Each frame's worth of names is stat'ed as one batch
+    const size_t header_len = 1 + 8 + 4;
+    list_batch_t batch = {0};
+    struct dirent *pending = NULL;  // Read but didn't fit the previous frame
+    bool end = false;
+    bool done = false;
+    while (!done) {
+        list_batch_reset(&batch);
+        while (1) {
+            if (limit != 0 && listed + batch.count >= limit) {
+                done = true;
+                break;
+            }
+            entry = pending;
+            pending = NULL;
+            if (!entry) {
+                while ((entry = readdir(dir)) != NULL && list_skip_entry(entry)) {
+                }
+            }
+            if (!entry) {
+                end = true;
+                done = true;
+                break;
+            }
+            if (header_len + batch.bytes + LIST_ENTRY_SIZE(strlen(entry->d_name)) > LIST_FRAME_SIZE) {
+                pending = entry;
+                break;
+            }
+            if (!list_batch_add(&batch, entry)) {
+                // Out of memory - stop here, the cursor lets the client resume
+                done = true;
+                break;
+            }
+        }
+        
+        stat_items(dirfd(dir), batch.names, batch.items, batch.count);
+        list_batch_encode(&batch, frame + header_len);
+        uint32_t count = (uint32_t)batch.count;
+        listed += count;
+        position += count;
+        frame[0] = done ? (LIST_FLAG_LAST | (end ? LIST_FLAG_END : 0)) : 0;
+        memcpy(frame + 1, &position, 8);
+        memcpy(frame + 9, &count, 4);
+        send_response(session, RESP_DATA, frame, (uint32_t)(header_len + batch.bytes));
+    }
+    
+    list_batch_free(&batch);
+    closedir(dir);
+    pool_release(frame);
+}
+
+// Handle CREATE_DIR
+void handle_create_dir(client_session_t *session, const char *path) {
+    if (mkdir_recursive(path) == 0) {
+        list_cache_invalidate(path);
+        send_ok(session, "Directory created");
+    } else {
+        send_error(session, "Failed to create directory");
+    }
+}
+
+// Handle DELETE_FILE
+void handle_delete_file(client_session_t *session, const char *path) {
+    char normalized_path[MAX_PATH];
+    snprintf(normalized_path, sizeof(normalized_path), "%s", path);
+    normalize_path(normalized_path);
+    
+    if (unlink(normalized_path) == 0) {
+        list_cache_invalidate(normalized_path);
+        send_ok(session, "File deleted");
+    } else {
+        send_error(session, "Failed to delete file");
+    }
+}
+
+// Background deletion thread data
+typedef struct {
+    char path[MAX_PATH];
+    int client_sock;
+} delete_thread_data_t;
+
+// Background deletion thread
+// Final empty OK/ERROR of a directory delete. Returns false if nobody is listening.
+static bool send_delete_result(uint8_t response) {
+    if (t_progress_session) {
+        send_response(t_progress_session, response, NULL, 0);
+        return true;
+    }
+    if (g_client_sock > 0) {
+        uint8_t header[5];
+        header[0] = response;
+        uint32_t len = 0;
+        memcpy(header + 1, &len, 4);
+        send(g_client_sock, header, 5, 0);
+        return true;
+    }
+    return false;
+}
+
+void* delete_thread_func(void* arg) {
+    delete_thread_data_t* data = (delete_thread_data_t*)arg;
+    
+    // Reset ALL progress counters
+    g_delete_count = 0;
+    g_scan_count = 0;
+    g_last_notify = time(NULL);
+    g_last_scan_notify = time(NULL);
+    if (!t_progress_session) {
+        g_client_sock = data->client_sock;
+    }
+    
+    // Count total files first
+    char start_msg[256];
+    snprintf(start_msg, sizeof(start_msg), "📊 Scanning folder: %s", data->path);
+    send_progress_message(start_msg);
+    
+    g_total_files = count_files_recursive(data->path);
+    
+    if (g_total_files == 0) {
+        char empty_msg[256];
+        snprintf(empty_msg, sizeof(empty_msg), "⚠️ Folder is empty or already deleted");
+        send_progress_message(empty_msg);
+        
+        // Still try to delete the empty folder itself
+        rmdir(data->path);
+        dir_cache_invalidate(data->path);
+        list_cache_invalidate(data->path);
+        
+        // Send final OK response even for empty folders
+        send_delete_result(RESP_OK);
+        
+        if (!t_progress_session) {
+            g_client_sock = 0;
+        }
+        free(data);
+        return NULL;
+    }
+    
+    char count_msg[256];
+    snprintf(count_msg, sizeof(count_msg), "📊 Total: %d files to delete", g_total_files);
+    send_progress_message(count_msg);
+    
+    // Start deletion
+    char del_msg[256];
+    snprintf(del_msg, sizeof(del_msg), "🗑️ Starting deletion...");
+    send_progress_message(del_msg);
+    
+    // Perform deletion in background
+    int result = rmdir_recursive(data->path);
+    dir_cache_invalidate(data->path);
+    list_cache_invalidate(data->path);
+    
+    // Send completion message
+    if (result == 0) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "✅ Deleted %d files (100%%)", g_delete_count);
+        send_progress_message(msg);
+        send_notification(msg);
+        
+        // Send final OK response to signal completion
+        if (send_delete_result(RESP_OK)) {
+            // Force flush and wait for data to be sent
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 200000000; // 200ms
+            nanosleep(&ts, NULL);
+        }
+    } else {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "❌ Failed to delete folder (%d files removed)", g_delete_count);
+        send_progress_message(msg);
+        
+        // Send error response
+        if (send_delete_result(RESP_ERROR)) {
+            // Force flush and wait for data to be sent
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 200000000; // 200ms
+            nanosleep(&ts, NULL);
+        }
+    }
+    
+    if (!t_progress_session) {
+        g_client_sock = 0;
+    }
+    free(data);
+    return NULL;
+}
+
+// Handle DELETE_DIR - BUG FIX: Async deletion with progress reporting
+void handle_delete_dir(client_session_t *session, const char *path) {
+    // DO NOT send OK immediately - let background thread handle all responses
+    // This prevents "Unexpected response: Data" error
+    
+    // Stop mkdir_recursive trusting this tree while it's being removed
+    dir_cache_invalidate(path);
+    
+    // Create background thread for deletion
+    delete_thread_data_t* data = malloc(sizeof(delete_thread_data_t));
+    if (data && (session->features & FEATURE_MUX)) {
+        // Already on this request's own thread - delete here, replies carry its id
+        strncpy(data->path, path, MAX_PATH - 1);
+        data->path[MAX_PATH - 1] = '\0';
+        data->client_sock = 0;
+        t_progress_session = session;
+        delete_thread_func(data);
+        t_progress_session = NULL;
+    } else if (data) {
+        strncpy(data->path, path, MAX_PATH - 1);
+        data->path[MAX_PATH - 1] = '\0';
+        data->client_sock = session->sock;
+        
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        
+        if (pthread_create(&thread, &attr, delete_thread_func, data) != 0) {
+            // Thread creation failed, delete synchronously and send response
+            free(data);
+            g_client_sock = session->sock;
+            int result = rmdir_recursive(path);
+            dir_cache_invalidate(path);
+            list_cache_invalidate(path);
+            if (result == 0) {
+                send_ok(session, "Folder deleted");
+            } else {
+                send_error(session, "Failed to delete folder");
+            }
+            g_client_sock = 0;
+        }
+        
+        pthread_attr_destroy(&attr);
+    } else {
+        // Malloc failed, delete synchronously and send response
+        g_client_sock = session->sock;
+        int result = rmdir_recursive(path);
+        dir_cache_invalidate(path);
+        list_cache_invalidate(path);
+        if (result == 0) {
+            send_ok(session, "Folder deleted");
+        } else {
+            send_error(session, "Failed to delete folder");
+        }
+        g_client_sock = 0;
+    }
+}
+
+// Handle RENAME
+void handle_rename(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *old_path = (const char *)data;
+    uint32_t old_len = strlen(old_path);
+    if (old_len + 2 > data_len) {
+        send_error(session, "Invalid rename request");
+        return;
+    }
+    const char *new_path = (const char *)(data + old_len + 1);
+    
+    char norm_old[MAX_PATH], norm_new[MAX_PATH];
+    snprintf(norm_old, sizeof(norm_old), "%s", old_path);
+    snprintf(norm_new, sizeof(norm_new), "%s", new_path);
+    normalize_path(norm_old);
+    normalize_path(norm_new);
+    
+    if (rename(norm_old, norm_new) == 0) {
+        dir_cache_invalidate(norm_old);
+        list_cache_invalidate(norm_old);
+        list_cache_invalidate(norm_new);
+        send_ok(session, "Renamed successfully");
+    } else {
+        send_error(session, "Failed to rename");
+    }
+}
+
+// Handle COPY_FILE
+void handle_copy_file(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *src = (const char *)data;
+    uint32_t src_len = strlen(src);
+    if (src_len + 2 > data_len) {
+        send_error(session, "Invalid copy request");
+        return;
+    }
+    const char *dst = (const char *)(data + src_len + 1);
+    
+    char norm_src[MAX_PATH], norm_dst[MAX_PATH];
+    snprintf(norm_src, sizeof(norm_src), "%s", src);
+    snprintf(norm_dst, sizeof(norm_dst), "%s", dst);
+    normalize_path(norm_src);
+    normalize_path(norm_dst);
+    
+    int src_fd = open(norm_src, O_RDONLY);
+    if (src_fd < 0) {
+        send_error(session, "Cannot open source file");
+        return;
+    }
+    
+    int dst_fd = open(norm_dst, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (dst_fd < 0) {
+        close(src_fd);
+        send_error(session, "Cannot create destination file");
+        return;
+    }
+    
+    // Smaller buffer when the pool is busy - copy just takes more iterations
+    size_t buf_size = 0;
+    uint8_t *buf = pool_acquire(POOL_MIN_BUFFER, BUFFER_SIZE, &buf_size);
+    if (!buf) {
+        close(src_fd);
+        close(dst_fd);
+        send_error(session, "Memory allocation failed");
+        return;
+    }
+    
+    ssize_t n;
+    int success = 1;
+    while ((n = read(src_fd, buf, buf_size)) > 0) {
+        if (write(dst_fd, buf, n) != n) {
+            success = 0;
+            break;
+        }
+    }
+    
+    pool_release(buf);
+    close(src_fd);
+    close(dst_fd);
+    chmod(norm_dst, 0777);
+    list_cache_invalidate(norm_dst);
+    
+    if (success) {
+        send_ok(session, "File copied");
+    } else {
+        send_error(session, "Failed to copy file");
+    }
+}
+
+// Handle MOVE_FILE
+void handle_move_file(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *src = (const char *)data;
+    uint32_t src_len = strlen(src);
+    if (src_len + 2 > data_len) {
+        send_error(session, "Invalid move request");
+        return;
+    }
+    const char *dst = (const char *)(data + src_len + 1);
+    
+    char norm_src[MAX_PATH], norm_dst[MAX_PATH];
+    snprintf(norm_src, sizeof(norm_src), "%s", src);
+    snprintf(norm_dst, sizeof(norm_dst), "%s", dst);
+    normalize_path(norm_src);
+    normalize_path(norm_dst);
+    
+    if (rename(norm_src, norm_dst) == 0) {
+        dir_cache_invalidate(norm_src);
+        list_cache_invalidate(norm_src);
+        list_cache_invalidate(norm_dst);
+        send_ok(session, "File moved");
+    } else {
+        send_error(session, "Failed to move file");
+    }
+}
 
-// Count files in directory recursively with progress updates
-int count_files_recursive(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        return 0;
+// Hand the session's running range digest to the file state, where it is
+// joined with the ranges other stripes hashed
+static void upload_digest_commit(client_session_t *session) {
+    if (session->digest.len == 0) return;
+    file_state_t *fs = session->file_state;
+    if (fs) {
+        pthread_mutex_lock(&fs->mutex);
+        digests_add(fs, session->digest.offset, session->digest.len, session->digest.crc);
+        pthread_mutex_unlock(&fs->mutex);
     }
+    session->digest_last = session->digest;
+    session->digest.len = 0;
+}
 
-    int count = 0;
-    struct dirent *entry;
-    char child[MAX_PATH];
+// Hash a received piece while it is still hot in cache. A jump in offset
+// starts a new range; SHA-256 only survives strictly sequential data.
+static void upload_digest_update(client_session_t *session, uint64_t offset, const uint8_t *data, size_t len) {
+    if (session->digest.len > 0 && session->digest.offset + session->digest.len != offset) {
+        upload_digest_commit(session);
+    }
+    if (session->digest.len == 0) {
+        session->digest.offset = offset;
+        session->digest.crc = 0;
+    }
+    session->digest.crc = crc32c_update(session->digest.crc, data, len);
+    session->digest.len += len;
     
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    if (session->sha && session->sha_ok) {
+        if (offset == session->sha->total) {
+            sha256_update(session->sha, data, len);
+        } else {
+            session->sha_ok = false;
         }
-        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    }
+}
 
-        struct stat st;
-        if (stat(child, &st) != 0) {
-            continue;
+// Finish with the session's upload file: wait for queued writes, then drop the
+// resume journal if every byte has landed or checkpoint it if not, close and
+// release. Returns the first write error from the pipeline (0 if none).
+int upload_close(client_session_t *session) {
+    int err = upload_pipe_drain(&session->pipe);
+    upload_digest_commit(session);
+    free(session->sha);
+    session->sha = NULL;
+    
+    file_state_t *fs = session->file_state;
+    if (fs) {
+        pthread_mutex_lock(&fs->mutex);
+        bool journaled = fs->journaled;
+        bool complete = ranges_complete(fs);
+        session->upload_complete = complete;
+        if (journaled && complete) {
+            fs->journaled = false;
         }
-        if (S_ISDIR(st.st_mode)) {
-            count++;  // Count the directory itself
-            count += count_files_recursive(child);  // Count its contents
-        } else {
-            count++;
-            g_scan_count++;
-            
-            // Send progress every 500 files or every 3 seconds during counting
-            time_t now = time(NULL);
-            if (g_scan_count % 500 == 0 || (now - g_last_scan_notify) >= 3) {
-                char msg[256];
-                snprintf(msg, sizeof(msg), "📊 Scanning... found %d files so far", g_scan_count);
-                send_progress_message(msg);
-                g_last_scan_notify = now;
+        pthread_mutex_unlock(&fs->mutex);
+        
+        if (journaled) {
+            if (complete) {
+                journal_remove(fs->path);
+            } else {
+                file_state_checkpoint(fs, session->upload_fd);
             }
         }
     }
-    closedir(dir);
-    return count;
-}
-
-// Send progress message to client
-void send_progress_message(const char *msg) {
-    if (g_client_sock > 0) {
-        uint8_t header[5];
-        header[0] = RESP_PROGRESS;
-        uint32_t len = strlen(msg) + 1;
-        memcpy(header + 1, &len, 4);
-        send(g_client_sock, header, 5, 0);
-        send(g_client_sock, msg, len, 0);
+    
+    session->upload_replace_failed = false;
+    if (fs && session->upload_final[0] && session->upload_complete) {
+        // Every stripe of a delta upload sees it complete - the first one to
+        // get here moves the rebuilt file over the old one
+        bool replaced = false;
+        pthread_mutex_lock(&fs->mutex);
+        if (!fs->renamed) {
+            chmod(session->upload_path, 0777);
+            if (rename(session->upload_path, session->upload_final) == 0) {
+                fs->renamed = true;
+                replaced = true;
+            } else {
+                session->upload_replace_failed = true;
+            }
+        }
+        pthread_mutex_unlock(&fs->mutex);
+        if (replaced) {
+            list_cache_invalidate(session->upload_final);
+        }
+    }
+    
+    close(session->upload_fd);
+    session->upload_fd = -1;
+    if (session->basis_fd >= 0) {
+        close(session->basis_fd);
+        session->basis_fd = -1;
     }
+    bool last = true;
+    if (fs) {
+        last = release_file_state(session->upload_path) == 0;
+        session->file_state = NULL;
+    }
+    session->upload_discarded = false;
+    if (session->upload_final[0] && !session->upload_complete && last) {
+        // No connection is left to fill the gaps - drop the half-built delta
+        // file, the original stays untouched
+        unlink(session->upload_path);
+        journal_remove(session->upload_path);
+        session->upload_discarded = true;
+    }
+    list_cache_invalidate(session->upload_path);
+    if (session->admitted) {
+        admit_release(session->upload_path);
+        session->admitted = false;
+    }
+    if (session->transfer) {
+        transfer_stripe_end(session->transfer, session->upload_complete);
+        session->transfer = NULL;
+    }
+    return err;
 }
 
-// Recursive directory deletion with progress reporting
-int rmdir_recursive(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) {
+// Pre-allocate the full size so parallel stripes can write anywhere
+static int upload_preallocate(int fd, uint64_t file_size) {
+    if (pwrite(fd, "", 1, (off_t)(file_size - 1)) != 1) {
         return -1;
     }
+    return 0;
+}
 
-    struct dirent *entry;
-    char child[MAX_PATH];
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
-
-        struct stat st;
-        if (stat(child, &st) != 0) {
-            continue;
-        }
-        if (S_ISDIR(st.st_mode)) {
-            rmdir_recursive(child);
-        } else {
-            unlink(child);
-            g_delete_count++;
+// Open path as the start of a new upload, or to resume one, and reset fs to
+// match (caller holds fs->mutex). A fresh file is pre-allocated when
+// prealloc is set, a resumed one whenever it is short. Returns the fd, or -1;
+// *prealloc_failed reports a failed pre-allocation (fd is still open).
+static int upload_open_file(file_state_t *fs, const char *path, uint64_t file_size,
+                            bool resume, bool prealloc, bool *prealloc_failed) {
+    int fd;
+    *prealloc_failed = false;
+    if (resume) {
+        // Resume: keep whatever is already on disk
+        fd = open(path, O_WRONLY | O_CREAT, 0777);
+        if (fd >= 0 && !fs->journaled) {
+            // First connection resuming this file - pick up the journal
+            if (journal_load(fs) != 0 || fs->file_size != file_size) {
+                fs->range_count = 0;  // No journal, or it describes another file
+            }
+            fs->digest_count = 0;  // Bytes from before the restart were never hashed
+            fs->digests_broken = false;
+            fs->renamed = false;
+            fs->file_size = file_size;
+            fs->journaled = true;
             
-            // Send progress every 50 files or every 2 seconds
-            time_t now = time(NULL);
-            if (g_delete_count % 50 == 0 || (now - g_last_notify) >= 2) {
-                int percentage = (g_total_files > 0) ? (g_delete_count * 100 / g_total_files) : 0;
-                char msg[256];
-                snprintf(msg, sizeof(msg), "🗑️ Deleting... %d/%d files (%d%%)", 
-                         g_delete_count, g_total_files, percentage);
-                send_progress_message(msg);
-                g_last_notify = now;
+            struct stat st;
+            if (file_size > 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size < file_size) {
+                *prealloc_failed = upload_preallocate(fd, file_size) != 0;
             }
         }
+        return fd;
     }
-    closedir(dir);
-    return rmdir(path);
+    
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    fs->range_count = 0;
+    fs->unsaved_bytes = 0;
+    fs->digest_count = 0;
+    fs->digests_broken = false;
+    fs->renamed = false;
+    fs->file_size = file_size;
+    fs->journaled = file_size >= RESUME_MIN_SIZE;
+    journal_remove(path);  // Stale journal from an earlier attempt
+    if (fd >= 0 && prealloc && file_size > 0) {
+        *prealloc_failed = upload_preallocate(fd, file_size) != 0;
+    }
+    return fd;
 }
 
-// Handle PING
-void handle_ping(client_session_t *session) {
-    send_ok(session->sock, "PONG");
+// Make fd the session's upload file. The session takes over fd, basis_fd and
+// the reference to fs.
+static void upload_attach(client_session_t *session, int fd, file_state_t *fs, const char *path,
+                          uint64_t file_size, uint64_t offset, uint32_t flags,
+                          int basis_fd, const char *final_path) {
+    session->upload_fd = fd;
+    session->basis_fd = basis_fd;
+    snprintf(session->upload_final, sizeof(session->upload_final), "%s", final_path);
+    session->upload_complete = false;
+    session->file_state = fs;
+    strncpy(session->upload_path, path, sizeof(session->upload_path) - 1);
+    session->upload_size = file_size;
+    session->upload_offset = offset;
+    session->upload_received = 0;
+    session->upload_flags = flags;
+    memset(&session->digest, 0, sizeof(session->digest));
+    memset(&session->digest_last, 0, sizeof(session->digest_last));
+    if ((flags & UPLOAD_FLAG_SHA256) && offset == 0 && !(flags & UPLOAD_FLAG_RESUME)) {
+        session->sha = (sha256_ctx_t *)malloc(sizeof(sha256_ctx_t));
+        if (session->sha) {
+            sha256_init(session->sha);
+        }
+    }
+    session->sha_ok = session->sha != NULL;
+    
+    struct stat upload_st;
+    session->upload_blksize = (fstat(session->upload_fd, &upload_st) == 0 && upload_st.st_blksize > 0)
+                              ? (uint32_t)upload_st.st_blksize : 0;
 }
 
-// REMOVED: handle_list_storage() - No longer show disk space to avoid privacy concerns
-
-// Handle LIST_DIR - Optimized version using d_type only (no stat for dirs)
-void handle_list_dir(client_session_t *session, const char *path) {
+// Handle START_UPLOAD
+// Payload: path + '\0' + size(8) [+ chunk_offset(8) for parallel upload [+ flags(4)]]
+// UPLOAD_FLAG_RESUME keeps the existing (pre-allocated) file and its resume
+// journal instead of truncating, so only the missing ranges need to be sent.
+// UPLOAD_FLAG_DIGEST / UPLOAD_FLAG_SHA256 select the END_UPLOAD digest reply.
+// UPLOAD_FLAG_DELTA builds the file in "<path>.ps5delta" from UPLOAD_DELTA
+// copies of the existing file plus ordinary chunks for the changed blocks.
+void handle_start_upload(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (session->upload_fd >= 0) {
+        // Release previous file to prevent leak
+        upload_close(session);
+    }
+    
+    // Parse path, size, and optional offset
+    const char *path = (const char *)data;
+    uint32_t path_len = strlen(path);
+    if (path_len + 9 > data_len) {
+        send_error(session, "Invalid upload request");
+        return;
+    }
+    
+    // Normalize path to remove double slashes
     char norm_path[MAX_PATH];
     snprintf(norm_path, sizeof(norm_path), "%s", path);
     normalize_path(norm_path);
     
-    DIR *dir = opendir(norm_path);
-    if (!dir) {
-        int32_t count = 0;
-        send_response(session->sock, RESP_DATA, &count, 4);
+    uint64_t file_size;
+    memcpy(&file_size, data + path_len + 1, 8);
+    
+    // Check for optional offset (for chunked parallel upload)
+    uint64_t chunk_offset = 0;
+    if (path_len + 17 <= data_len) {
+        memcpy(&chunk_offset, data + path_len + 9, 8);
+    }
+    
+    uint32_t flags = 0;
+    if (path_len + 21 <= data_len) {
+        memcpy(&flags, data + path_len + 17, 4);
+    }
+    
+    // Delta upload: the new file is assembled next to the old one, which
+    // stays readable for UPLOAD_DELTA copies until END_UPLOAD swaps them
+    int basis_fd = -1;
+    char final_path[MAX_PATH] = "";
+    if (flags & UPLOAD_FLAG_DELTA) {
+        basis_fd = open(norm_path, O_RDONLY);
+        if (basis_fd < 0) {
+            send_error(session, "Cannot open delta basis file");
+            return;
+        }
+        snprintf(final_path, sizeof(final_path), "%s", norm_path);
+        snprintf(norm_path, sizeof(norm_path), "%s%s", final_path, DELTA_TEMP_SUFFIX);
+    }
+    
+    // Large files need an upload slot, or queue and run again later
+    int admitted = admit_acquire(session, norm_path, file_size, CMD_START_UPLOAD, data, data_len);
+    if (admitted < 0) {
+        if (basis_fd >= 0) close(basis_fd);
+        return;  // Queued or turned away - replied already
+    }
+    
+    // Create parent directories
+    char parent[MAX_PATH];
+    strncpy(parent, norm_path, sizeof(parent) - 1);
+    parent[sizeof(parent) - 1] = '\0';
+    char *last_slash = strrchr(parent, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+        mkdir_recursive(parent);
+    }
+    
+    // Get shared state for this specific file
+    file_state_t *fs = get_file_state(norm_path);
+    if (!fs) {
+        if (basis_fd >= 0) close(basis_fd);
+        if (admitted) admit_release(norm_path);
+        send_error(session, "Cannot allocate file mutex");
         return;
     }
     
-    size_t buf_size = 256 * 1024;
-    uint8_t *buffer = malloc(buf_size);
-    if (!buffer) {
-        closedir(dir);
-        int32_t count = 0;
-        send_response(session->sock, RESP_DATA, &count, 4);
+    // CRITICAL: Lock mutex BEFORE opening file to prevent race condition
+    // when multiple threads try to create the same file simultaneously
+    pthread_mutex_lock(&fs->mutex);
+    
+    // Open file for writing using direct syscalls (faster than FILE*)
+    // For chunked uploads, we need to pre-allocate the file on first chunk.
+    // The mutex only guards creation/pre-allocation - chunks are written with
+    // pwrite() at explicit offsets, so no seek position is shared or locked.
+    int fd;
+    bool prealloc_failed = false;
+    if (flags & UPLOAD_FLAG_RESUME) {
+        fd = upload_open_file(fs, norm_path, file_size, true, true, &prealloc_failed);
+    } else if (chunk_offset > 0) {
+        // Subsequent chunk: open existing file
+        fd = open(norm_path, O_WRONLY);
+        if (fs->file_size == 0) {
+            fs->file_size = file_size;
+        }
+    } else {
+        // First chunk or small file: create new file. Large files are
+        // pre-allocated for chunked upload.
+        fd = upload_open_file(fs, norm_path, file_size, false, file_size > 100 * 1024 * 1024, &prealloc_failed);
+    }
+    
+    if (prealloc_failed) {
+        // Pre-allocation failed - likely disk full
+        fs->journaled = false;
+        pthread_mutex_unlock(&fs->mutex);
+        close(fd);
+        if (basis_fd >= 0) close(basis_fd);
+        release_file_state(norm_path);
+        if (admitted) admit_release(norm_path);
+        if (!(flags & UPLOAD_FLAG_RESUME)) {
+            unlink(norm_path); // Remove partial file
+        }
+        send_error(session, "Disk full - cannot pre-allocate file");
         return;
     }
     
-    uint8_t *ptr = buffer + 4;
-    int32_t entry_count = 0;
+    pthread_mutex_unlock(&fs->mutex);
     
-    struct dirent *entry;
-    char full_path[MAX_PATH];
+    if (fd < 0) {
+        if (basis_fd >= 0) close(basis_fd);
+        release_file_state(norm_path);
+        if (admitted) admit_release(norm_path);
+        send_error(session, "Cannot create file");
+        return;
+    }
     
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+    upload_attach(session, fd, fs, norm_path, file_size, chunk_offset, flags, basis_fd, final_path);
+    session->admitted = admitted > 0;
+    send_response(session, RESP_READY, NULL, 0);
+}
+
+// Encode an UPLOAD_QUERY reply for the ranges in fs (caller holds fs->mutex if shared)
+static uint8_t *encode_missing_ranges(const file_state_t *fs, bool has_journal, size_t *reply_len) {
+    size_t count = has_journal ? (size_t)fs->range_count + 1 : 0;
+    uint8_t *reply = (uint8_t *)malloc(21 + 16 * count);
+    if (!reply) return NULL;
+    
+    uint8_t *ptr = reply + 21;
+    uint32_t missing = 0;
+    uint64_t received = 0;
+    uint64_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        bool last = (i == (size_t)fs->range_count);
+        uint64_t next = last ? fs->file_size : fs->ranges[i].offset;
+        if (next > fs->file_size) next = fs->file_size;
+        if (next > pos) {
+            uint64_t gap = next - pos;
+            memcpy(ptr, &pos, 8);
+            memcpy(ptr + 8, &gap, 8);
+            ptr += 16;
+            missing++;
         }
-        
-        uint16_t name_len = (uint16_t)strlen(entry->d_name);
-        size_t needed = 1 + 2 + name_len + 8 + 8;
-        
-        if ((size_t)(ptr - buffer) + needed > buf_size) {
-            break;
+        if (!last) {
+            received += fs->ranges[i].len;
+            uint64_t end = fs->ranges[i].offset + fs->ranges[i].len;
+            if (end > pos) pos = end;
         }
-        
-        // Determine type and get file size
-        uint8_t type = 0;
-        uint64_t size = 0;
-        uint64_t timestamp = 0;
-        
-        snprintf(full_path, sizeof(full_path), "%s/%s", norm_path, entry->d_name);
-        struct stat st;
-        
-        if (entry->d_type == DT_DIR) {
-            type = 1;
-        } else if (entry->d_type == DT_UNKNOWN) {
-            // d_type not supported on this filesystem - use stat() as fallback
-            if (stat(full_path, &st) == 0) {
-                if (S_ISDIR(st.st_mode)) {
-                    type = 1;
-                } else {
-                    size = st.st_size;
-                    timestamp = st.st_mtime;
-                }
-            }
-        } else {
-            // Regular file - get size
-            if (stat(full_path, &st) == 0) {
-                size = st.st_size;
-                timestamp = st.st_mtime;
+    }
+    
+    reply[0] = has_journal ? 1 : 0;
+    memcpy(reply + 1, &fs->file_size, 8);
+    memcpy(reply + 9, &received, 8);
+    memcpy(reply + 17, &missing, 4);
+    *reply_len = (size_t)(ptr - reply);
+    return reply;
+}
+
+// Handle UPLOAD_QUERY - which ranges of an interrupted upload are still missing
+// Payload: path + '\0'
+// Reply RESP_DATA: has_journal(1) + file_size(8) + received(8) + count(4)
+//                  + count * (offset(8) + len(8)) missing ranges
+// Without a journal nothing is known about the file and the client should
+// send it whole.
+void handle_upload_query(client_session_t *session, const char *path) {
+    char norm_path[MAX_PATH];
+    snprintf(norm_path, sizeof(norm_path), "%s", path);
+    normalize_path(norm_path);
+    
+    uint8_t *reply;
+    size_t reply_len = 0;
+    file_state_t *fs = find_file_state(norm_path);
+    if (fs) {
+        // Upload still live - its in-memory ranges are the freshest
+        pthread_mutex_lock(&fs->mutex);
+        reply = encode_missing_ranges(fs, fs->journaled, &reply_len);
+        pthread_mutex_unlock(&fs->mutex);
+        release_file_state(norm_path);
+    } else {
+        file_state_t loaded;
+        memset(&loaded, 0, sizeof(loaded));
+        snprintf(loaded.path, sizeof(loaded.path), "%s", norm_path);
+        bool has_journal = journal_load(&loaded) == 0;
+        reply = encode_missing_ranges(&loaded, has_journal, &reply_len);
+        free(loaded.ranges);
+    }
+    
+    if (!reply) {
+        send_error(session, "Out of memory");
+        return;
+    }
+    send_response(session, RESP_DATA, reply, (uint32_t)reply_len);
+    free(reply);
+}
+
+// Abort the current upload after a failed write
+static void upload_write_failed(client_session_t *session) {
+    upload_close(session);
+    send_error(session, "Write failed");
+}
+
+// Chunks must stay inside the size given at START_UPLOAD - data past it would
+// grow the file and throw off range tracking and the resume journal
+static bool upload_chunk_in_range(const client_session_t *session, uint64_t offset, uint64_t len) {
+    return offset <= session->upload_size && len <= session->upload_size - offset;
+}
+
+// Stream a chunk payload of len bytes from the socket straight into pool
+// buffers, queueing each piece for a positional write at offset. Pieces shrink
+// when the pool is busy and end on filesystem block boundaries.
+// Returns -1 if the connection broke, 1 if the chunk was rejected unwritten,
+// 2 if a write failed (error already sent for both).
+static int upload_recv_chunk(client_session_t *session, uint64_t offset, uint64_t len) {
+    bool failed = false;
+    
+    if (!upload_chunk_in_range(session, offset, len)) {
+        if (recv_discard(session->sock, len) != 0) return -1;
+        send_error(session, "Invalid chunk");
+        return 1;
+    }
+    
+    while (len > 0) {
+        size_t want = len < BUFFER_SIZE ? (size_t)len : BUFFER_SIZE;
+        size_t got = 0;
+        uint8_t *buf = upload_pipe_buffer(&session->pipe, want, &got);
+        if (!buf) {
+            return -1;
+        }
+        size_t piece = got < len ? got : (size_t)len;
+        if (piece < len && session->upload_blksize > 0) {
+            // Not the last piece - stop at a block boundary so the next write is aligned
+            size_t over = (size_t)((offset + piece) % session->upload_blksize);
+            if (over < piece) {
+                piece -= over;
             }
         }
+        if (recv_full(session->sock, buf, piece) != 0) {
+            pool_release(buf);
+            return -1;
+        }
+        link_tune(session, LINK_RX, piece);
+        transfer_pace(session, piece);
+        if (!failed) {
+            upload_digest_update(session, offset, buf, piece);
+        }
         
-        *ptr++ = type;
-        memcpy(ptr, &name_len, 2);
-        ptr += 2;
-        memcpy(ptr, entry->d_name, name_len);
-        ptr += name_len;
-        memcpy(ptr, &size, 8);
-        ptr += 8;
-        memcpy(ptr, &timestamp, 8);
-        ptr += 8;
+        if (failed) {
+            // Keep reading so the stream stays in sync, drop the data
+            pool_release(buf);
+        } else if (upload_pipe_error(&session->pipe) != 0) {
+            // Surface errors from earlier writes before accepting more data
+            pool_release(buf);
+            failed = true;
+        } else if (upload_pipe_submit(&session->pipe, session->upload_fd, session->file_state, offset, buf, piece) != 0) {
+            failed = true;
+        } else {
+            session->upload_received += piece;
+        }
         
-        entry_count++;
+        offset += piece;
+        len -= piece;
+    }
+    
+    if (failed) {
+        upload_write_failed(session);
+        return 2;
+    }
+    // No response - zero blocking for maximum speed
+    return 0;
+}
+
+// Handle UPLOAD_CHUNK - sequential chunk, written at the session's running offset.
+// The payload is read from the socket here. Returns -1 if the connection broke.
+int handle_upload_chunk(client_session_t *session, uint32_t data_len) {
+    if (session->upload_fd < 0 || !session->file_state) {
+        if (recv_discard(session->sock, data_len) != 0) return -1;
+        send_error(session, "No upload in progress");
+        return 0;
+    }
+    
+    // pwrite at our own offset - parallel stripes of the SAME file never block each other
+    uint64_t offset = session->upload_offset;
+    int rc = upload_recv_chunk(session, offset, data_len);
+    if (rc == 0 || rc == 2) {
+        // A rejected chunk leaves the running offset where it was
+        session->upload_offset = offset + data_len;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+// Handle UPLOAD_CHUNK_AT - chunk with explicit 64-bit file offset
+// Payload: offset(8) + data
+int handle_upload_chunk_at(client_session_t *session, uint32_t data_len) {
+    if (data_len < 8) {
+        if (recv_discard(session->sock, data_len) != 0) return -1;
+        send_error(session, "Invalid chunk");
+        return 0;
+    }
+    
+    uint64_t offset;
+    if (recv_full(session->sock, &offset, 8) != 0) return -1;
+    
+    if (session->upload_fd < 0 || !session->file_state) {
+        if (recv_discard(session->sock, data_len - 8) != 0) return -1;
+        send_error(session, "No upload in progress");
+        return 0;
+    }
+    
+    return upload_recv_chunk(session, offset, data_len - 8) < 0 ? -1 : 0;
+}
+
+// Handle UPLOAD_CHUNK_Z - positional chunk that may be compressed
+// Payload: offset(8) + raw_len(4) + codec(1) + stored bytes
+// CODEC_RAW is an ordinary chunk. CODEC_LZ4 (after HELLO with FEATURE_LZ4) is
+// one LZ4 block of up to BUFFER_SIZE bytes, decompressed by the disk worker.
+int handle_upload_chunk_z(client_session_t *session, uint32_t data_len) {
+    if (data_len < 13) {
+        if (recv_discard(session->sock, data_len) != 0) return -1;
+        send_error(session, "Invalid chunk");
+        return 0;
+    }
+    
+    uint8_t hdr[13];
+    if (recv_full(session->sock, hdr, sizeof(hdr)) != 0) return -1;
+    uint64_t offset;
+    uint32_t raw_len;
+    memcpy(&offset, hdr, 8);
+    memcpy(&raw_len, hdr + 8, 4);
+    uint8_t codec = hdr[12];
+    uint32_t stored = data_len - 13;
+    
+    if (session->upload_fd < 0 || !session->file_state) {
+        if (recv_discard(session->sock, stored) != 0) return -1;
+        send_error(session, "No upload in progress");
+        return 0;
+    }
+    if (codec == CODEC_RAW) {
+        return upload_recv_chunk(session, offset, stored) < 0 ? -1 : 0;
+    }
+    if (codec != CODEC_LZ4 || !(session->features & FEATURE_LZ4) ||
+        raw_len == 0 || raw_len > BUFFER_SIZE || stored > BUFFER_SIZE) {
+        if (recv_discard(session->sock, stored) != 0) return -1;
+        send_error(session, "Invalid compressed chunk");
+        return 0;
+    }
+    if (!upload_chunk_in_range(session, offset, raw_len)) {
+        if (recv_discard(session->sock, stored) != 0) return -1;
+        send_error(session, "Invalid chunk");
+        return 0;
     }
     
-    closedir(dir);
-    memcpy(buffer, &entry_count, 4);
-    send_response(session->sock, RESP_DATA, buffer, (uint32_t)(ptr - buffer));
-    free(buffer);
-}
-
-// Handle CREATE_DIR
-void handle_create_dir(client_session_t *session, const char *path) {
-    if (mkdir_recursive(path) == 0) {
-        send_ok(session->sock, "Directory created");
-    } else {
-        send_error(session->sock, "Failed to create directory");
+    // The block can't be split - wait for a buffer that holds all of it
+    uint8_t *buf = upload_pipe_buffer_min(&session->pipe, stored, stored, NULL);
+    if (!buf) {
+        return -1;
     }
-}
-
-// Handle DELETE_FILE
-void handle_delete_file(client_session_t *session, const char *path) {
-    char normalized_path[MAX_PATH];
-    snprintf(normalized_path, sizeof(normalized_path), "%s", path);
-    normalize_path(normalized_path);
+    if (recv_full(session->sock, buf, stored) != 0) {
+        pool_release(buf);
+        return -1;
+    }
+    link_tune(session, LINK_RX, stored);
+    transfer_pace(session, stored);
     
-    if (unlink(normalized_path) == 0) {
-        send_ok(session->sock, "File deleted");
-    } else {
-        send_error(session->sock, "Failed to delete file");
+    if (upload_pipe_error(&session->pipe) != 0) {
+        pool_release(buf);
+        upload_write_failed(session);
+        return 0;
+    }
+    // The worker hashes the expanded bytes; close the session's running range
+    upload_digest_commit(session);
+    session->sha_ok = false;
+    if (upload_pipe_submit_packed(&session->pipe, session->upload_fd, session->file_state,
+                                  offset, buf, stored, raw_len) != 0) {
+        upload_write_failed(session);
+        return 0;
     }
+    session->upload_received += raw_len;
+    codec_count(&g_codec_upload, raw_len, stored);
+    return 0;
 }
 
-// Background deletion thread data
-typedef struct {
-    char path[MAX_PATH];
-    int client_sock;
-} delete_thread_data_t;
-
-// Background deletion thread
-void* delete_thread_func(void* arg) {
-    delete_thread_data_t* data = (delete_thread_data_t*)arg;
-    
-    // Reset ALL progress counters
-    g_delete_count = 0;
-    g_scan_count = 0;
-    g_last_notify = time(NULL);
-    g_last_scan_notify = time(NULL);
-    g_client_sock = data->client_sock;
+// Handle UPLOAD_STREAM - payload: length(8) [+ offset(8)]
+// The socket then carries exactly `length` raw file bytes with no per-chunk
+// framing. They are written from the upload's running offset (or the given
+// one) and a single status reply follows once everything is on disk.
+// Returns -1 if the connection broke.
+int handle_upload_stream(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (data_len < 8) {
+        send_error(session, "Invalid stream request");
+        return 0;
+    }
     
-    // Count total files first
-    char start_msg[256];
-    snprintf(start_msg, sizeof(start_msg), "📊 Scanning folder: %s", data->path);
-    send_progress_message(start_msg);
+    uint64_t length;
+    memcpy(&length, data, 8);
+    uint64_t offset = session->upload_offset;
+    if (data_len >= 16) {
+        memcpy(&offset, data + 8, 8);
+    }
     
-    g_total_files = count_files_recursive(data->path);
+    if (session->upload_fd < 0 || !session->file_state) {
+        if (recv_discard(session->sock, length) != 0) return -1;
+        send_error(session, "No upload in progress");
+        return 0;
+    }
     
-    if (g_total_files == 0) {
-        char empty_msg[256];
-        snprintf(empty_msg, sizeof(empty_msg), "⚠️ Folder is empty or already deleted");
-        send_progress_message(empty_msg);
-        
-        // Still try to delete the empty folder itself
-        rmdir(data->path);
-        
-        // Send final OK response even for empty folders
-        if (g_client_sock > 0) {
-            uint8_t header[5];
-            header[0] = RESP_OK;
-            uint32_t len = 0;
-            memcpy(header + 1, &len, 4);
-            send(g_client_sock, header, 5, 0);
-        }
-        
-        g_client_sock = 0;
-        free(data);
-        return NULL;
+    int rc = upload_recv_chunk(session, offset, length);
+    if (rc != 0) {
+        return rc < 0 ? -1 : 0;
     }
+    session->upload_offset = offset + length;
     
-    char count_msg[256];
-    snprintf(count_msg, sizeof(count_msg), "📊 Total: %d files to delete", g_total_files);
-    send_progress_message(count_msg);
+    if (upload_pipe_drain(&session->pipe) != 0) {
+        // Late write error - abort like a failed chunk
+        upload_write_failed(session);
+        return 0;
+    }
     
-    // Start deletion
-    char del_msg[256];
-    snprintf(del_msg, sizeof(del_msg), "🗑️ Starting deletion...");
-    send_progress_message(del_msg);
+    char msg[64];
+    snprintf(msg, sizeof(msg), "Stream complete: %llu bytes", (unsigned long long)length);
+    send_ok(session, msg);
+    return 0;
+}
+
+// Receive one UPLOAD_BATCH record and write its file inline.
+// *err gets 0 or the errno that failed this file (its bytes are still consumed).
+// Returns -1 if the connection broke.
+static int batch_recv_file(client_session_t *session, const char *root,
+                           uint8_t *buf, size_t buf_size, int *err) {
+    uint16_t name_len;
+    if (recv_full(session->sock, &name_len, 2) != 0) return -1;
+    
+    char rel[MAX_PATH];
+    *err = 0;
+    if (name_len >= sizeof(rel)) {
+        if (recv_discard(session->sock, name_len) != 0) return -1;
+        *err = ENAMETOOLONG;
+    } else {
+        if (recv_full(session->sock, rel, name_len) != 0) return -1;
+        rel[name_len] = '\0';
+    }
     
-    // Perform deletion in background
-    int result = rmdir_recursive(data->path);
+    uint8_t rec[12];
+    if (recv_full(session->sock, rec, sizeof(rec)) != 0) return -1;
+    uint64_t size;
+    uint32_t mode;
+    memcpy(&size, rec, 8);
+    memcpy(&mode, rec + 8, 4);
     
-    // Send completion message
-    if (result == 0) {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "✅ Deleted %d files (100%%)", g_delete_count);
-        send_progress_message(msg);
-        send_notification(msg);
+    char full_path[MAX_PATH];
+    int fd = -1;
+    if (!*err && snprintf(full_path, sizeof(full_path), "%s/%s", root, rel) >= (int)sizeof(full_path)) {
+        // Never write to a shortened path - it names some other file
+        *err = ENAMETOOLONG;
+    }
+    if (!*err) {
+        normalize_path(full_path);
         
-        // Send final OK response to signal completion
-        if (g_client_sock > 0) {
-            uint8_t header[5];
-            header[0] = RESP_OK;
-            uint32_t len = 0;
-            memcpy(header + 1, &len, 4);
-            send(g_client_sock, header, 5, 0);
-            
-            // Force flush and wait for data to be sent
-            struct timespec ts;
-            ts.tv_sec = 0;
-            ts.tv_nsec = 200000000; // 200ms
-            nanosleep(&ts, NULL);
+        char *last_slash = strrchr(full_path, '/');
+        if (last_slash && last_slash != full_path) {
+            *last_slash = '\0';
+            mkdir_recursive(full_path);
+            *last_slash = '/';
         }
-    } else {
-        char msg[256];
-        snprintf(msg, sizeof(msg), "❌ Failed to delete folder (%d files removed)", g_delete_count);
-        send_progress_message(msg);
         
-        // Send error response
-        if (g_client_sock > 0) {
-            uint8_t header[5];
-            header[0] = RESP_ERROR;
-            uint32_t len = 0;
-            memcpy(header + 1, &len, 4);
-            send(g_client_sock, header, 5, 0);
-            
-            // Force flush and wait for data to be sent
-            struct timespec ts;
-            ts.tv_sec = 0;
-            ts.tv_nsec = 200000000; // 200ms
-            nanosleep(&ts, NULL);
+        fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        if (fd < 0) {
+            *err = errno;
         }
     }
     
-    g_client_sock = 0;
-    free(data);
-    return NULL;
+    // Receive the file body, writing it if the file opened
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t piece = (size - offset) < buf_size ? (size_t)(size - offset) : buf_size;
+        if (recv_full(session->sock, buf, piece) != 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        if (fd >= 0 && !*err && write_full_at(fd, buf, piece, offset) != (ssize_t)piece) {
+            *err = errno ? errno : EIO;
+        }
+        offset += piece;
+    }
+    
+    if (fd >= 0) {
+        if (close(fd) != 0 && !*err) {
+            *err = errno;
+        }
+        chmod(full_path, mode ? (mode & 07777) : 0777);
+        list_cache_invalidate(full_path);
+    }
+    return 0;
 }
 
-// Handle DELETE_DIR - BUG FIX: Async deletion with progress reporting
-void handle_delete_dir(client_session_t *session, const char *path) {
-    // DO NOT send OK immediately - let background thread handle all responses
-    // This prevents "Unexpected response: Data" error
+// Handle UPLOAD_BATCH - many small files in one request
+// Payload: root path + '\0' + count(4)
+// The socket then carries `count` records back to back:
+//   path_len(2) + relative path + size(8) + mode(4) + `size` raw bytes
+// Each file is created, written and closed inline - no per-file round trips.
+// One RESP_DATA reply follows with count(4) and per file: status(1, 0 = ok)
+// + errno(4), in record order. Returns -1 if the connection broke.
+int handle_upload_batch(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *root = (const char *)data;
+    uint32_t root_len = strnlen(root, data_len);
+    if (root_len + 5 > data_len) {
+        send_error(session, "Invalid batch request");
+        return 0;
+    }
     
-    // Create background thread for deletion
-    delete_thread_data_t* data = malloc(sizeof(delete_thread_data_t));
-    if (data) {
-        strncpy(data->path, path, MAX_PATH - 1);
-        data->path[MAX_PATH - 1] = '\0';
-        data->client_sock = session->sock;
-        
-        pthread_t thread;
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        
-        if (pthread_create(&thread, &attr, delete_thread_func, data) != 0) {
-            // Thread creation failed, delete synchronously and send response
-            free(data);
-            g_client_sock = session->sock;
-            int result = rmdir_recursive(path);
-            if (result == 0) {
-                send_ok(session->sock, "Folder deleted");
-            } else {
-                send_error(session->sock, "Failed to delete folder");
-            }
-            g_client_sock = 0;
+    uint32_t count;
+    memcpy(&count, data + root_len + 1, 4);
+    
+    size_t results_len = 4 + (size_t)count * 5;
+    uint8_t *results = malloc(results_len);
+    size_t buf_size = 0;
+    uint8_t *buf = pool_acquire(POOL_MIN_BUFFER, 1024 * 1024, &buf_size);
+    if (!results || !buf) {
+        // The records are already on the wire - drop the connection
+        free(results);
+        pool_release(buf);
+        send_error(session, "Out of memory");
+        return -1;
+    }
+    memcpy(results, &count, 4);
+    
+    for (uint32_t i = 0; i < count; i++) {
+        int err;
+        if (batch_recv_file(session, root, buf, buf_size, &err) != 0) {
+            pool_release(buf);
+            free(results);
+            return -1;
         }
         
-        pthread_attr_destroy(&attr);
-    } else {
-        // Malloc failed, delete synchronously and send response
-        g_client_sock = session->sock;
-        int result = rmdir_recursive(path);
-        if (result == 0) {
-            send_ok(session->sock, "Folder deleted");
-        } else {
-            send_error(session->sock, "Failed to delete folder");
-        }
-        g_client_sock = 0;
+        uint8_t *res = results + 4 + (size_t)i * 5;
+        int32_t err32 = err;
+        res[0] = err ? 1 : 0;
+        memcpy(res + 1, &err32, 4);
     }
+    
+    pool_release(buf);
+    send_response(session, RESP_DATA, results, (uint32_t)results_len);
+    free(results);
+    return 0;
 }
 
-// Handle RENAME
-void handle_rename(client_session_t *session, const uint8_t *data, uint32_t data_len) {
-    const char *old_path = (const char *)data;
-    uint32_t old_len = strlen(old_path);
-    if (old_len + 2 > data_len) {
-        send_error(session->sock, "Invalid rename request");
+// Handle END_UPLOAD
+// Without a digest flag the reply is the plain "Upload complete". With
+// UPLOAD_FLAG_DIGEST / UPLOAD_FLAG_SHA256 it is RESP_DATA:
+//   received(8) + file_crc_valid(1) + file_crc32c(4)
+//   + range_offset(8) + range_len(8) + range_crc32c(4)
+//   + sha_valid(1) + sha256(32)
+// The range is the last contiguous range this connection sent. The file CRC
+// is valid once every stripe has ended, so the last stripe's reply carries it.
+void handle_end_upload(client_session_t *session) {
+    if (session->upload_fd < 0) {
+        send_error(session, "No upload in progress");
         return;
     }
-    const char *new_path = (const char *)(data + old_len + 1);
     
-    char norm_old[MAX_PATH], norm_new[MAX_PATH];
-    snprintf(norm_old, sizeof(norm_old), "%s", old_path);
-    snprintf(norm_new, sizeof(norm_new), "%s", new_path);
-    normalize_path(norm_old);
-    normalize_path(norm_new);
+    // Wait for the disk workers to finish every queued chunk - packed chunks
+    // are only hashed once a worker has expanded them
+    int err = upload_pipe_drain(&session->pipe);
     
-    if (rename(norm_old, norm_new) == 0) {
-        send_ok(session->sock, "Renamed successfully");
+    uint8_t reply[66];
+    memset(reply, 0, sizeof(reply));
+    bool want_digest = (session->upload_flags & (UPLOAD_FLAG_DIGEST | UPLOAD_FLAG_SHA256)) != 0;
+    if (want_digest) {
+        upload_digest_commit(session);
+        
+        uint32_t file_crc = 0;
+        pthread_mutex_lock(&session->file_state->mutex);
+        bool file_crc_valid = digests_whole_file(session->file_state, &file_crc);
+        pthread_mutex_unlock(&session->file_state->mutex);
+        
+        memcpy(reply, &session->upload_received, 8);
+        reply[8] = file_crc_valid ? 1 : 0;
+        memcpy(reply + 9, &file_crc, 4);
+        memcpy(reply + 13, &session->digest_last.offset, 8);
+        memcpy(reply + 21, &session->digest_last.len, 8);
+        memcpy(reply + 29, &session->digest_last.crc, 4);
+        if (session->sha && session->sha_ok && session->sha->total == session->upload_size) {
+            reply[33] = 1;
+            sha256_final(session->sha, reply + 34);
+        }
+    }
+    
+    bool striped = session->transfer != NULL;
+    int close_err = upload_close(session);
+    if (!err) {
+        err = close_err;
+    }
+    
+    chmod(session->upload_path, 0777);
+    
+    if (err) {
+        send_error(session, "Write failed");
+        return;
+    }
+    if (session->upload_discarded) {
+        send_error(session, "Delta incomplete");
+        return;
+    }
+    if (session->upload_replace_failed) {
+        send_error(session, "Cannot replace file with delta result");
+        return;
+    }
+    if (want_digest) {
+        send_response(session, RESP_DATA, reply, sizeof(reply));
+    } else if (striped) {
+        send_ok(session, session->upload_complete ? "Transfer complete" : "Stripe complete");
     } else {
-        send_error(session->sock, "Failed to rename");
+        send_ok(session, "Upload complete");
     }
 }
 
-// Handle COPY_FILE
-void handle_copy_file(client_session_t *session, const uint8_t *data, uint32_t data_len) {
-    const char *src = (const char *)data;
-    uint32_t src_len = strlen(src);
-    if (src_len + 2 > data_len) {
-        send_error(session->sock, "Invalid copy request");
+// Handle TRANSFER_CREATE
+// Payload: path + '\0' + size(8) + stripes(4) [+ flags(4) [+ rate(8)]]
+// Reply RESP_DATA: transfer_id(4)
+// Creates and pre-allocates the file once for all stripes. UPLOAD_FLAG_RESUME
+// keeps the existing file and its journal, as with START_UPLOAD. rate caps
+// the stripes together in bytes per second (0 = unlimited).
+void handle_transfer_create(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *path = (const char *)data;
+    uint32_t path_len = strnlen(path, data_len);
+    if (path_len + 13 > data_len) {
+        send_error(session, "Invalid transfer request");
+        return;
+    }
+    uint64_t file_size;
+    uint32_t stripes;
+    uint32_t flags = 0;
+    memcpy(&file_size, data + path_len + 1, 8);
+    memcpy(&stripes, data + path_len + 9, 4);
+    uint64_t rate = 0;
+    if (path_len + 17 <= data_len) {
+        memcpy(&flags, data + path_len + 13, 4);
+    }
+    if (path_len + 25 <= data_len) {
+        memcpy(&rate, data + path_len + 17, 8);
+    }
+    if (stripes == 0 || stripes > TRANSFER_MAX_STRIPES) {
+        send_error(session, "Invalid stripe count");
         return;
     }
-    const char *dst = (const char *)(data + src_len + 1);
     
-    char norm_src[MAX_PATH], norm_dst[MAX_PATH];
-    snprintf(norm_src, sizeof(norm_src), "%s", src);
-    snprintf(norm_dst, sizeof(norm_dst), "%s", dst);
-    normalize_path(norm_src);
-    normalize_path(norm_dst);
+    char norm_path[MAX_PATH];
+    snprintf(norm_path, sizeof(norm_path), "%s", path);
+    normalize_path(norm_path);
+    char parent[MAX_PATH];
+    snprintf(parent, sizeof(parent), "%s", norm_path);
+    char *last_slash = strrchr(parent, '/');
+    if (last_slash) {
+        *last_slash = '\0';
+        mkdir_recursive(parent);
+    }
     
-    int src_fd = open(norm_src, O_RDONLY);
-    if (src_fd < 0) {
-        send_error(session->sock, "Cannot open source file");
+    file_state_t *fs = get_file_state(norm_path);
+    if (!fs) {
+        send_error(session, "Cannot allocate file mutex");
         return;
     }
+    pthread_mutex_lock(&fs->mutex);
+    bool prealloc_failed;
+    bool resume = (flags & UPLOAD_FLAG_RESUME) != 0;
+    int fd = upload_open_file(fs, norm_path, file_size, resume, true, &prealloc_failed);
+    if (prealloc_failed) {
+        fs->journaled = false;
+    }
+    pthread_mutex_unlock(&fs->mutex);
     
-    int dst_fd = open(norm_dst, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-    if (dst_fd < 0) {
-        close(src_fd);
-        send_error(session->sock, "Cannot create destination file");
+    if (fd < 0 || prealloc_failed) {
+        if (fd >= 0) {
+            close(fd);
+            if (!resume) unlink(norm_path);
+        }
+        release_file_state(norm_path);
+        send_error(session, fd < 0 ? "Cannot create file" : "Disk full - cannot pre-allocate file");
         return;
     }
+    close(fd);  // Stripes open their own descriptors
     
-    char *buf = malloc(BUFFER_SIZE);
-    if (!buf) {
-        close(src_fd);
-        close(dst_fd);
-        send_error(session->sock, "Memory allocation failed");
+    uint32_t id = transfer_create(norm_path, file_size, stripes, rate);
+    if (id == 0) {
+        release_file_state(norm_path);
+        send_error(session, "Too many transfers");
+        return;
+    }
+    send_response(session, RESP_DATA, &id, sizeof(id));
+}
+
+// Handle TRANSFER_JOIN
+// Payload: transfer_id(4) + offset(8) [+ flags(4)]
+// Replies RESP_READY like START_UPLOAD; offset is where sequential
+// UPLOAD_CHUNKs of this stripe start. Only UPLOAD_FLAG_DIGEST and
+// UPLOAD_FLAG_SHA256 apply to a stripe.
+void handle_transfer_join(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (data_len < 12) {
+        send_error(session, "Invalid join request");
         return;
     }
+    if (session->upload_fd >= 0) {
+        upload_close(session);
+    }
+    uint32_t id;
+    uint64_t offset;
+    uint32_t flags = 0;
+    memcpy(&id, data, 4);
+    memcpy(&offset, data + 4, 8);
+    if (data_len >= 16) {
+        memcpy(&flags, data + 12, 4);
+    }
+    flags &= UPLOAD_FLAG_DIGEST | UPLOAD_FLAG_SHA256;
     
-    ssize_t n;
-    int success = 1;
-    while ((n = read(src_fd, buf, BUFFER_SIZE)) > 0) {
-        if (write(dst_fd, buf, n) != n) {
-            success = 0;
-            break;
-        }
+    char path[MAX_PATH];
+    uint64_t file_size = 0;
+    const char *error = NULL;
+    transfer_t *t = transfer_join(id, path, sizeof(path), &file_size, &error);
+    if (!t) {
+        send_error(session, error);
+        return;
     }
     
-    free(buf);
-    close(src_fd);
-    close(dst_fd);
-    chmod(norm_dst, 0777);
+    int admitted = admit_acquire(session, path, file_size, CMD_TRANSFER_JOIN, data, data_len);
+    if (admitted < 0) {
+        transfer_stripe_end(t, false);
+        return;  // Queued or turned away - replied already
+    }
     
-    if (success) {
-        send_ok(session->sock, "File copied");
-    } else {
-        send_error(session->sock, "Failed to copy file");
+    // The transfer holds a reference, so this is the state it set up
+    file_state_t *fs = get_file_state(path);
+    int fd = fs ? open(path, O_WRONLY) : -1;
+    if (fd < 0) {
+        if (fs) release_file_state(path);
+        if (admitted) admit_release(path);
+        transfer_stripe_end(t, false);
+        send_error(session, "Cannot open transfer file");
+        return;
     }
+    
+    upload_attach(session, fd, fs, path, file_size, offset, flags, -1, "");
+    session->admitted = admitted > 0;
+    session->transfer = t;
+    send_response(session, RESP_READY, NULL, 0);
 }
 
-// Handle MOVE_FILE
-void handle_move_file(client_session_t *session, const uint8_t *data, uint32_t data_len) {
-    const char *src = (const char *)data;
-    uint32_t src_len = strlen(src);
-    if (src_len + 2 > data_len) {
-        send_error(session->sock, "Invalid move request");
+// Handle TRANSFER_STATUS
+// Payload: transfer_id(4)
+// Reply RESP_DATA: size(8) + received(8) + stripes(4) + joined(4) + active(4) + complete(1)
+void handle_transfer_status(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (data_len < 4) {
+        send_error(session, "Invalid status request");
+        return;
+    }
+    uint32_t id;
+    memcpy(&id, data, 4);
+    
+    uint8_t reply[29];
+    char path[MAX_PATH];
+    pthread_mutex_lock(&g_transfer_lock);
+    transfer_t *t = transfer_find(id);
+    if (t) {
+        memcpy(reply, &t->file_size, 8);
+        memcpy(reply + 16, &t->stripes, 4);
+        memcpy(reply + 20, &t->joined, 4);
+        memcpy(reply + 24, &t->active, 4);
+        reply[28] = t->complete ? 1 : 0;
+        snprintf(path, sizeof(path), "%s", t->path);
+    }
+    pthread_mutex_unlock(&g_transfer_lock);
+    if (!t) {
+        send_error(session, "Unknown transfer");
         return;
     }
-    const char *dst = (const char *)(data + src_len + 1);
-    
-    char norm_src[MAX_PATH], norm_dst[MAX_PATH];
-    snprintf(norm_src, sizeof(norm_src), "%s", src);
-    snprintf(norm_dst, sizeof(norm_dst), "%s", dst);
-    normalize_path(norm_src);
-    normalize_path(norm_dst);
     
-    if (rename(norm_src, norm_dst) == 0) {
-        send_ok(session->sock, "File moved");
-    } else {
-        send_error(session->sock, "Failed to move file");
+    uint64_t received = 0;
+    file_state_t *fs = find_file_state(path);
+    if (fs) {
+        pthread_mutex_lock(&fs->mutex);
+        for (int i = 0; i < fs->range_count; i++) {
+            received += fs->ranges[i].len;
+        }
+        pthread_mutex_unlock(&fs->mutex);
+        release_file_state(path);
     }
+    memcpy(reply + 8, &received, 8);
+    send_response(session, RESP_DATA, reply, sizeof(reply));
 }
 
-// Handle START_UPLOAD (with optional chunk offset for parallel upload)
-void handle_start_upload(client_session_t *session, const uint8_t *data, uint32_t data_len) {
-    if (session->upload_fd >= 0) {
-        close(session->upload_fd);
-        session->upload_fd = -1;
-        // Release previous file mutex to prevent leak
-        if (session->file_mutex) {
-            release_file_mutex(session->upload_path);
-            session->file_mutex = NULL;
-        }
-    }
-    
-    // Parse path, size, and optional offset
+// ============================================================================
+// DELTA SYNC
+// ============================================================================
+// BLOCK_SIGNATURES describes an existing file as fixed-size blocks, each with
+// an rsync-style rolling checksum and a truncated SHA-256. The client rolls the
+// weak checksum over its new copy to find blocks the console already has, then
+// uploads with UPLOAD_FLAG_DELTA: UPLOAD_DELTA copies the known blocks out of
+// the old file and ordinary chunks carry the rest.
+
+#define DELTA_MIN_BLOCK (4 * 1024)
+#define DELTA_MAX_BLOCK (64 * 1024 * 1024)
+#define DELTA_STRONG_LEN 16                    // Bytes of SHA-256 kept per block
+#define DELTA_MAX_REPLY (64 * 1024 * 1024)    // Caps the signature count
+#define DELTA_MAX_OPS 4096                     // Copies per UPLOAD_DELTA
+
+// Handle BLOCK_SIGNATURES
+// Payload: path + '\0' + block_size(4)
+// Reply RESP_DATA: file_size(8) + block_size(4) + count(4)
+//                  + count * (weak(4) + strong(16))
+// weak = a | (b << 16), a = sum of bytes, b = sum of running a, both mod 2^16.
+// The last block may be short. One sequential pass with large reads.
+void handle_block_signatures(client_session_t *session, const uint8_t *data, uint32_t data_len) {
     const char *path = (const char *)data;
     uint32_t path_len = strlen(path);
-    if (path_len + 9 > data_len) {
-        send_error(session->sock, "Invalid upload request");
+    if (path_len + 5 > data_len) {
+        send_error(session, "Invalid signature request");
+        return;
+    }
+    uint32_t block_size;
+    memcpy(&block_size, data + path_len + 1, 4);
+    if (block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK) {
+        send_error(session, "Invalid block size");
         return;
     }
     
-    // Normalize path to remove double slashes
     char norm_path[MAX_PATH];
     snprintf(norm_path, sizeof(norm_path), "%s", path);
     normalize_path(norm_path);
     
-    uint64_t file_size;
-    memcpy(&file_size, data + path_len + 1, 8);
-    
-    // Check for optional offset (for chunked parallel upload)
-    uint64_t chunk_offset = 0;
-    if (path_len + 17 <= data_len) {
-        memcpy(&chunk_offset, data + path_len + 9, 8);
+    int fd = open(norm_path, O_RDONLY);
+    if (fd < 0) {
+        send_error(session, "Cannot open file");
+        return;
     }
-    
-    // Create parent directories
-    char parent[MAX_PATH];
-    strncpy(parent, norm_path, sizeof(parent) - 1);
-    parent[sizeof(parent) - 1] = '\0';
-    char *last_slash = strrchr(parent, '/');
-    if (last_slash) {
-        *last_slash = '\0';
-        mkdir_recursive(parent);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        send_error(session, "Cannot stat file");
+        return;
     }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
     
-    // Get per-file mutex for this specific file
-    session->file_mutex = get_file_mutex(norm_path);
-    if (!session->file_mutex) {
-        send_error(session->sock, "Cannot allocate file mutex");
+    uint64_t file_size = st.st_size;
+    uint64_t count = (file_size + block_size - 1) / block_size;
+    size_t entry_len = 4 + DELTA_STRONG_LEN;
+    if (count * entry_len + 16 > DELTA_MAX_REPLY) {
+        close(fd);
+        send_error(session, "Block size too small for file");
         return;
     }
     
-    // CRITICAL: Lock mutex BEFORE opening file to prevent race condition
-    // when multiple threads try to create the same file simultaneously
-    pthread_mutex_lock(session->file_mutex);
-    
-    // Open file for writing using direct syscalls (faster than FILE*)
-    // For chunked uploads, we need to pre-allocate the file on first chunk
-    if (chunk_offset > 0) {
-        // Subsequent chunk: open existing file
-        session->upload_fd = open(norm_path, O_WRONLY);
-        if (session->upload_fd >= 0) {
-            // Seek to chunk offset
-            lseek(session->upload_fd, chunk_offset, SEEK_SET);
+    size_t reply_len = 16 + (size_t)count * entry_len;
+    uint8_t *reply = (uint8_t *)malloc(reply_len);
+    size_t buf_size = 0;
+    uint8_t *buf = pool_acquire(POOL_MIN_BUFFER, BUFFER_SIZE, &buf_size);
+    if (!reply || !buf) {
+        free(reply);
+        pool_release(buf);
+        close(fd);
+        send_error(session, "Out of memory");
+        return;
+    }
+    uint32_t count32 = (uint32_t)count;
+    memcpy(reply, &file_size, 8);
+    memcpy(reply + 8, &block_size, 4);
+    memcpy(reply + 12, &count32, 4);
+    
+    // Blocks may be larger or smaller than the read buffer - hash as a stream
+    uint8_t *entry = reply + 16;
+    uint32_t a = 0, b = 0;
+    uint32_t in_block = 0;
+    sha256_ctx_t sha;
+    sha256_init(&sha);
+    uint64_t pos = 0;
+    bool failed = false;
+    while (pos < file_size) {
+        ssize_t n = pread(fd, buf, buf_size, (off_t)pos);
+        if (n <= 0) {
+            failed = true;
+            break;
         }
-    } else {
-        // First chunk or small file: create new file
-        session->upload_fd = open(norm_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-        if (session->upload_fd >= 0 && file_size > 100 * 1024 * 1024) {
-            // Large file - pre-allocate full size for chunked upload
-            if (lseek(session->upload_fd, file_size - 1, SEEK_SET) < 0 || write(session->upload_fd, "", 1) != 1) {
-                // Pre-allocation failed - likely disk full
-                close(session->upload_fd);
-                session->upload_fd = -1;
-                pthread_mutex_unlock(session->file_mutex);
-                release_file_mutex(norm_path);
-                session->file_mutex = NULL;
-                unlink(norm_path); // Remove partial file
-                send_error(session->sock, "Disk full - cannot pre-allocate file");
-                return;
+        pos += n;
+        
+        const uint8_t *p = buf;
+        size_t left = (size_t)n;
+        while (left > 0) {
+            size_t take = block_size - in_block;
+            if (take > left) take = left;
+            for (size_t i = 0; i < take; i++) {
+                a += p[i];
+                b += a;
             }
+            sha256_update(&sha, p, take);
+            in_block += take;
+            p += take;
+            left -= take;
             
-            // Seek back to beginning
-            lseek(session->upload_fd, 0, SEEK_SET);
+            if (in_block == block_size || (left == 0 && pos >= file_size)) {
+                uint32_t weak = (a & 0xFFFF) | (b << 16);
+                uint8_t digest[32];
+                sha256_final(&sha, digest);
+                memcpy(entry, &weak, 4);
+                memcpy(entry + 4, digest, DELTA_STRONG_LEN);
+                entry += entry_len;
+                a = b = 0;
+                in_block = 0;
+                sha256_init(&sha);
+            }
         }
     }
     
-    pthread_mutex_unlock(session->file_mutex);
-    
-    if (session->upload_fd < 0) {
-        release_file_mutex(norm_path);
-        session->file_mutex = NULL;
-        send_error(session->sock, "Cannot create file");
+    pool_release(buf);
+    close(fd);
+    if (failed || entry != reply + reply_len) {
+        free(reply);
+        send_error(session, "Read failed");
         return;
     }
-    
-    strncpy(session->upload_path, norm_path, sizeof(session->upload_path) - 1);
-    session->upload_size = file_size;
-    session->upload_received = chunk_offset;
-    
-    // Increase socket receive buffer for this upload session
-    int huge_buf = 16 * 1024 * 1024; // 16MB receive buffer - matches download optimization
-    setsockopt(session->sock, SOL_SOCKET, SO_RCVBUF, &huge_buf, sizeof(huge_buf));
-    
-    send_response(session->sock, RESP_READY, NULL, 0);
+    send_response(session, RESP_DATA, reply, (uint32_t)reply_len);
+    free(reply);
 }
 
-// Handle UPLOAD_CHUNK
-void handle_upload_chunk(client_session_t *session, const uint8_t *data, uint32_t data_len) {
-    if (session->upload_fd < 0 || !session->file_mutex) {
-        send_error(session->sock, "No upload in progress");
+// Handle UPLOAD_DELTA - copy ranges of the old file into the delta upload
+// Payload: count(4) + count * (dst_offset(8) + src_offset(8) + len(8))
+// Like chunks there is no reply on success. Copied bytes go through the same
+// write pipeline, so they count toward completion, the resume journal and the
+// END_UPLOAD digest.
+void handle_upload_delta(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (session->upload_fd < 0 || session->basis_fd < 0) {
+        send_error(session, "No delta upload in progress");
+        return;
+    }
+    uint32_t count = 0;
+    if (data_len >= 4) {
+        memcpy(&count, data, 4);
+    }
+    if (data_len < 4 || count > DELTA_MAX_OPS || 4 + (uint64_t)count * 24 > data_len) {
+        send_error(session, "Invalid delta request");
         return;
     }
     
-    // Lock ONLY this file's mutex - other files can write in parallel!
-    pthread_mutex_lock(session->file_mutex);
+    const uint8_t *op = data + 4;
+    for (uint32_t i = 0; i < count; i++, op += 24) {
+        uint64_t dst, src, len;
+        memcpy(&dst, op, 8);
+        memcpy(&src, op + 8, 8);
+        memcpy(&len, op + 16, 8);
+        if (!upload_chunk_in_range(session, dst, len)) {
+            upload_close(session);
+            send_error(session, "Delta copy out of range");
+            return;
+        }
+        
+        while (len > 0) {
+            size_t want = len < BUFFER_SIZE ? (size_t)len : BUFFER_SIZE;
+            size_t got = 0;
+            uint8_t *buf = upload_pipe_buffer(&session->pipe, want, &got);
+            if (!buf) {
+                upload_write_failed(session);
+                return;
+            }
+            size_t piece = got < len ? got : (size_t)len;
+            ssize_t n = pread(session->basis_fd, buf, piece, (off_t)src);
+            if (n != (ssize_t)piece) {
+                // Reference past the end of the old file - the client's signatures are stale
+                pool_release(buf);
+                upload_close(session);
+                send_error(session, "Delta copy out of range");
+                return;
+            }
+            if (upload_pipe_error(&session->pipe) != 0) {
+                pool_release(buf);
+                upload_write_failed(session);
+                return;
+            }
+            upload_digest_update(session, dst, buf, piece);
+            if (upload_pipe_submit(&session->pipe, session->upload_fd, session->file_state, dst, buf, piece) != 0) {
+                upload_write_failed(session);
+                return;
+            }
+            session->upload_received += piece;
+            dst += piece;
+            src += piece;
+            len -= piece;
+        }
+    }
+}
+
+// ============================================================================
+// DOWNLOADS
+// ============================================================================
+// DOWNLOAD_FILE and DOWNLOAD_RANGE share one core that sends [offset,
+// offset + len) of an open file with pread(), so any number of connections can
+// pull different ranges of the same file at once.
+//
+// A reader thread fills a small ring of buffers ahead of the sender (and
+// compresses them in framed mode), so disk reads and socket sends overlap
+// instead of taking turns.
+//
+// Framed mode is used once FEATURE_LZ4 is negotiated. Each block is
+// codec(1) + raw_len(4) + stored_len(4) + stored bytes, LZ4 when that is
+// smaller, raw otherwise. Blocks are DOWNLOAD_BLOCK_SIZE so the link is not
+// idle for long while the next one is compressed.
+
+#define DOWNLOAD_BLOCK_SIZE (1024 * 1024)
+#define DOWNLOAD_READAHEAD 3  // Ring slots; more are only taken when the pool has them spare
+
+// sendfile() mode. Large single calls made FreeBSD push bursts that upset TCP
+// congestion control, so each call is bounded and only issued once the socket
+// buffer has room for it (SO_SNDLOWAT + poll). The low-water mark is half the
+// send buffer, which link tuning resizes - FreeBSD clamps it to the buffer,
+// so a larger mark would only wake the sender once the buffer ran dry.
+#define SENDFILE_CHUNK (1024 * 1024)
+
+// Per-mode totals so the copy loop and sendfile can be compared on the console
+typedef struct {
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t wall_us;
+    uint64_t cpu_us;   // Sending thread plus reader thread
+} download_mode_stats_t;
+
+#define DOWNLOAD_MODE_COPY 0
+#define DOWNLOAD_MODE_FRAMED 1
+#define DOWNLOAD_MODE_SENDFILE 2
+#define DOWNLOAD_MODE_COUNT 3
+
+static const char *g_download_mode_names[DOWNLOAD_MODE_COUNT] = {"copy", "lz4", "sendfile"};
+static download_mode_stats_t g_download_modes[DOWNLOAD_MODE_COUNT];
+static pthread_mutex_t g_download_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t thread_cpu_us() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void download_count(int mode, uint64_t bytes, uint64_t wall_us, uint64_t cpu_us) {
+    pthread_mutex_lock(&g_download_stats_lock);
+    download_mode_stats_t *m = &g_download_modes[mode];
+    m->transfers++;
+    m->bytes += bytes;
+    m->wall_us += wall_us;
+    m->cpu_us += cpu_us;
+    pthread_mutex_unlock(&g_download_stats_lock);
+}
+
+size_t download_format_stats(char *out, size_t out_size) {
+    size_t len = 0;
+    pthread_mutex_lock(&g_download_stats_lock);
+    for (int i = 0; i < DOWNLOAD_MODE_COUNT && len < out_size; i++) {
+        download_mode_stats_t *m = &g_download_modes[i];
+        double mb = m->bytes / (1024.0 * 1024.0);
+        len += snprintf(out + len, out_size - len,
+                        "download_%s=transfers:%llu bytes:%llu mbps:%.1f cpu_us_per_mb:%.0f\n",
+                        g_download_mode_names[i], (unsigned long long)m->transfers,
+                        (unsigned long long)m->bytes,
+                        m->wall_us ? mb * 1000000.0 / m->wall_us : 0.0,
+                        mb > 0 ? m->cpu_us / mb : 0.0);
+    }
+    pthread_mutex_unlock(&g_download_stats_lock);
+    return len < out_size ? len : out_size - 1;
+}
+
+// One bounded sendfile() call. Returns bytes sent, or -1 with errno set.
+static ssize_t sendfile_some(int sock, int fd, uint64_t offset, size_t len) {
+#ifdef __linux__
+    off_t off = (off_t)offset;
+    return sendfile(sock, fd, &off, len);
+#else
+    off_t sent = 0;
+    int rc = sendfile(fd, sock, (off_t)offset, len, NULL, &sent, 0);
+    if (rc != 0 && sent == 0) {
+        return -1;
+    }
+    return (ssize_t)sent;  // May be partial on EINTR/EAGAIN
+#endif
+}
+
+// Match SO_SNDLOWAT to the current send buffer: half of it, at most one
+// chunk. Caller holds send_lock. Returns the mark.
+static int sendfile_set_lowat(client_session_t *session) {
+    int sndbuf = 0;
+    socklen_t sndbuf_len = sizeof(sndbuf);
+    if (getsockopt(session->sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_len) != 0 || sndbuf <= 0) {
+        sndbuf = LINK_BUF_MIN;
+    }
+    int lowat = sndbuf / 2 < SENDFILE_CHUNK ? sndbuf / 2 : SENDFILE_CHUNK;
+    if (lowat != session->sendfile_lowat) {
+        setsockopt(session->sock, SOL_SOCKET, SO_SNDLOWAT, &lowat, sizeof(lowat));  // Not tunable everywhere
+        session->sendfile_lowat = lowat;
+    }
+    return lowat;
+}
+
+// Bytes the socket buffer takes now, at most one chunk. poll() reported it
+// writable, so that is at least the low-water mark.
+static size_t sendfile_room(int sock, int lowat) {
+    int room = lowat;
+#ifdef FIONSPACE
+    int space = 0;
+    if (ioctl(sock, FIONSPACE, &space) == 0 && space > room) {
+        room = space;
+    }
+#else
+    (void)sock;
+#endif
+    return room < SENDFILE_CHUNK ? (size_t)room : SENDFILE_CHUNK;
+}
+
+static bool download_sendfile(client_session_t *session, int fd, uint64_t offset, uint64_t len) {
+    // The socket outlives this download - remember the low-water mark it had.
+    // With FEATURE_MUX several downloads overlap, the first saves, the last restores.
+    pthread_mutex_lock(&session->send_lock);
+    if (session->sendfile_users++ == 0) {
+        socklen_t lowat_len = sizeof(session->saved_lowat);
+        if (getsockopt(session->sock, SOL_SOCKET, SO_SNDLOWAT, &session->saved_lowat, &lowat_len) != 0) {
+            session->saved_lowat = 1;
+        }
+        session->sendfile_lowat = 0;
+    }
+    int lowat = sendfile_set_lowat(session);
+    pthread_mutex_unlock(&session->send_lock);
+    
+    bool ok = true;
+    while (len > 0) {
+        struct pollfd pfd = { .fd = session->sock, .events = POLLOUT };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            ok = false;
+            break;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP)) {
+            ok = false;
+            break;
+        }
+        
+        // Each chunk is one RESP_DATA frame with FEATURE_MUX, so it goes out whole
+        size_t want = sendfile_room(session->sock, lowat);
+        if (want > len) {
+            want = (size_t)len;
+        }
+        size_t done = 0;
+        transfer_pace(session, want);
+        uint8_t header[9];
+        size_t header_len = 0;
+        if (session->features & FEATURE_MUX) {
+            header_len = response_header(session, header, RESP_DATA, (uint32_t)want);
+        }
+        pthread_mutex_lock(&session->send_lock);
+        // Queued responses go ahead of the file bytes
+        ok = output_put(session, header, header_len, NULL, 0, true) == 0;
+        while (ok && done < want) {
+            ssize_t n = sendfile_some(session->sock, fd, offset + done, want - done);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = false;  // Connection gone, or the file shrank
+                break;
+            }
+            done += n;
+        }
+        pthread_mutex_unlock(&session->send_lock);
+        if (!ok) break;
+        link_tune(session, LINK_TX, done);
+        offset += done;
+        len -= done;
+        if (len > 0) {
+            // Tuning may have resized the send buffer
+            pthread_mutex_lock(&session->send_lock);
+            lowat = sendfile_set_lowat(session);
+            pthread_mutex_unlock(&session->send_lock);
+        }
+    }
     
-    // Direct write syscall for maximum speed (matches download optimization)
-    ssize_t written = write(session->upload_fd, data, data_len);
+    pthread_mutex_lock(&session->send_lock);
+    if (--session->sendfile_users == 0) {
+        setsockopt(session->sock, SOL_SOCKET, SO_SNDLOWAT, &session->saved_lowat, sizeof(session->saved_lowat));
+    }
+    pthread_mutex_unlock(&session->send_lock);
+    return ok;
+}
+
+typedef struct {
+    uint8_t *in;        // Bytes produced (file data, or tree records)
+    uint8_t *out;       // Framed mode: LZ4 output, at most as large as in
+    size_t cap;
+    uint32_t raw_len;   // Bytes of in that are filled
+    uint32_t stored;    // Bytes to send - from out if codec is CODEC_LZ4
+    uint8_t codec;
+    bool full;
+} download_slot_t;
+
+// Ring between a producer thread (reads a file range, or walks a tree) and
+// the connection thread that sends the filled slots in order
+typedef struct {
+    download_slot_t slots[DOWNLOAD_READAHEAD];
+    int slot_count;
+    int next_fill;      // Producer's next slot
+    bool framed;
+    uint32_t *table;    // LZ4 hash table, framed mode only
+    bool done;          // Producer finished - nothing more will be published
+    bool failed;        // Producer stopped early (read error, file shrank)
+    bool stop;          // Sender gave up - producer must exit
+    uint64_t producer_cpu_us;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // What to produce
+    int fd;
+    uint64_t offset;
+    uint64_t len;
+    void *ctx;
+} download_ring_t;
+
+// Producer: wait for the next empty slot. NULL if the sender gave up.
+static download_slot_t *ring_claim(download_ring_t *ring) {
+    download_slot_t *slot = &ring->slots[ring->next_fill];
+    pthread_mutex_lock(&ring->mutex);
+    while (slot->full && !ring->stop) {
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+    }
+    bool stop = ring->stop;
+    pthread_mutex_unlock(&ring->mutex);
+    if (stop) {
+        return NULL;
+    }
+    slot->raw_len = 0;
+    return slot;
+}
+
+// Producer: hand a filled slot to the sender, compressing it in framed mode
+static void ring_publish(download_ring_t *ring, download_slot_t *slot) {
+    slot->stored = slot->raw_len;
+    slot->codec = CODEC_RAW;
+    if (ring->framed) {
+        size_t packed = lz4_compress(slot->in, slot->raw_len, slot->out, slot->raw_len - 1, ring->table);
+        if (packed) {
+            slot->stored = (uint32_t)packed;
+            slot->codec = CODEC_LZ4;
+        }
+    }
     
-    if (written != data_len) {
-        pthread_mutex_unlock(session->file_mutex);
-        send_error(session->sock, "Write failed");
-        close(session->upload_fd);
-        session->upload_fd = -1;
-        release_file_mutex(session->upload_path);
-        session->file_mutex = NULL;
-        return;
+    pthread_mutex_lock(&ring->mutex);
+    slot->full = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+    ring->next_fill = (ring->next_fill + 1) % ring->slot_count;
+}
+
+static void ring_finish(download_ring_t *ring, bool failed) {
+    ring->producer_cpu_us = thread_cpu_us();
+    pthread_mutex_lock(&ring->mutex);
+    ring->done = true;
+    ring->failed = failed;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+// Producer for a file range
+static void *download_reader(void *arg) {
+    download_ring_t *ring = (download_ring_t *)arg;
+    uint64_t offset = ring->offset;
+    uint64_t left = ring->len;
+    bool failed = false;
+    
+    while (left > 0) {
+        download_slot_t *slot = ring_claim(ring);
+        if (!slot) break;
+        
+        size_t want = left < slot->cap ? (size_t)left : slot->cap;
+        ssize_t n = pread(ring->fd, slot->in, want, (off_t)offset);
+        if (n <= 0) {
+            failed = true;
+            break;
+        }
+        slot->raw_len = (uint32_t)n;
+        ring_publish(ring, slot);
+        offset += n;
+        left -= n;
+    }
+    ring_finish(ring, failed);
+    return NULL;
+}
+
+// Borrow the ring's buffers - the first slot may wait for the pool, the rest
+// are only taken if they are free right now
+static bool download_ring_alloc(download_ring_t *ring) {
+    size_t min_size = ring->framed ? DOWNLOAD_BLOCK_SIZE : POOL_MIN_BUFFER;
+    size_t want_size = ring->framed ? DOWNLOAD_BLOCK_SIZE : BUFFER_SIZE;
+    for (int i = 0; i < DOWNLOAD_READAHEAD; i++) {
+        download_slot_t *slot = &ring->slots[i];
+        slot->in = (i == 0) ? pool_acquire(min_size, want_size, &slot->cap)
+                            : pool_try_acquire(min_size, want_size, &slot->cap);
+        if (slot->in && ring->framed) {
+            slot->out = (i == 0) ? pool_acquire(slot->cap, slot->cap, NULL)
+                                 : pool_try_acquire(slot->cap, slot->cap, NULL);
+            if (!slot->out) {
+                pool_release(slot->in);
+                slot->in = NULL;
+            }
+        }
+        if (!slot->in) break;
+        if (ring->framed && slot->cap > DOWNLOAD_BLOCK_SIZE) {
+            slot->cap = DOWNLOAD_BLOCK_SIZE;
+        }
+        ring->slot_count++;
     }
+    if (ring->slot_count > 0 && ring->framed) {
+        ring->table = (uint32_t *)malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+        return ring->table != NULL;
+    }
+    return ring->slot_count > 0;
+}
+
+// Run producer on its own thread and send everything it publishes. Returns 0
+// if the producer finished cleanly and every byte went out. *sent counts the
+// uncompressed bytes sent.
+static int download_ring_run(client_session_t *session, download_ring_t *ring,
+                             void *(*producer)(void *), uint64_t *sent) {
+    ring->framed = (session->features & FEATURE_LZ4) != 0;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    *sent = 0;
     
-    session->upload_received += written;
+    pthread_t thread;
+    bool started = download_ring_alloc(ring) && pthread_create(&thread, NULL, producer, ring) == 0;
+    int rc = started ? 0 : -1;
+    
+    int next = 0;
+    while (rc == 0) {
+        download_slot_t *slot = &ring->slots[next];
+        pthread_mutex_lock(&ring->mutex);
+        while (!slot->full && !ring->done) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+        }
+        bool full = slot->full;
+        bool failed = ring->failed;
+        pthread_mutex_unlock(&ring->mutex);
+        if (!full) {
+            rc = failed ? -1 : 0;
+            break;
+        }
+        
+        uint32_t wire_len = ring->framed ? slot->stored : slot->raw_len;
+        transfer_pace(session, wire_len);  // Before sending, so the limit holds for the last block too
+        if (ring->framed) {
+            uint8_t hdr[9];
+            hdr[0] = slot->codec;
+            memcpy(hdr + 1, &slot->raw_len, 4);
+            memcpy(hdr + 5, &slot->stored, 4);
+            // Block header and data leave in one writev()
+            rc = stream_queue(session, hdr, sizeof(hdr));
+            if (rc == 0) {
+                rc = send_stream(session, slot->codec == CODEC_LZ4 ? slot->out : slot->in, slot->stored);
+            }
+            codec_count(&g_codec_download, slot->raw_len, slot->stored);
+        } else {
+            rc = send_stream(session, slot->in, slot->raw_len);
+        }
+        if (rc == 0) {
+            *sent += slot->raw_len;
+            link_tune(session, LINK_TX, wire_len);
+        }
+        
+        pthread_mutex_lock(&ring->mutex);
+        slot->full = false;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->mutex);
+        next = (next + 1) % ring->slot_count;
+    }
     
-    pthread_mutex_unlock(session->file_mutex);
-    // No response - zero blocking for maximum speed
+    if (started) {
+        pthread_mutex_lock(&ring->mutex);
+        ring->stop = true;
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->mutex);
+        pthread_join(thread, NULL);
+    }
+    for (int i = 0; i < ring->slot_count; i++) {
+        pool_release(ring->slots[i].in);
+        pool_release(ring->slots[i].out);
+    }
+    free(ring->table);
+    pthread_mutex_destroy(&ring->mutex);
+    pthread_cond_destroy(&ring->cond);
+    return rc;
 }
 
-// Handle END_UPLOAD
-void handle_end_upload(client_session_t *session) {
-    if (session->upload_fd < 0) {
-        send_error(session->sock, "No upload in progress");
+// Send [offset, offset + len) of fd in the connection's negotiated format.
+// The length was already announced, so a failure part way (file shrank, no
+// memory) can only be signalled by dropping the connection.
+static void download_send(client_session_t *session, int fd, uint64_t offset, uint64_t len) {
+    uint64_t start_us = monotonic_us();
+    uint64_t start_cpu = thread_cpu_us();
+    if (len == 0) {
         return;
     }
     
-    // Direct close syscall (no buffering to flush)
-    close(session->upload_fd);
-    session->upload_fd = -1;
-    
-    if (session->file_mutex) {
-        release_file_mutex(session->upload_path);
-        session->file_mutex = NULL;
+    bool framed = (session->features & FEATURE_LZ4) != 0;
+    if (!framed && (session->features & FEATURE_SENDFILE)) {
+        bool sent = download_sendfile(session, fd, offset, len);
+        download_count(DOWNLOAD_MODE_SENDFILE, len, monotonic_us() - start_us, thread_cpu_us() - start_cpu);
+        if (!sent) {
+            shutdown(session->sock, SHUT_RDWR);
+        }
+        return;
     }
     
-    chmod(session->upload_path, 0777);
-    
-    send_ok(session->sock, "Upload complete");
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, (off_t)offset, (off_t)len, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    download_ring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = fd;
+    ring.offset = offset;
+    ring.len = len;
+    uint64_t sent = 0;
+    int rc = download_ring_run(session, &ring, download_reader, &sent);
+    
+    download_count(framed ? DOWNLOAD_MODE_FRAMED : DOWNLOAD_MODE_COPY, sent,
+                   monotonic_us() - start_us, thread_cpu_us() - start_cpu + ring.producer_cpu_us);
+    if (rc != 0) {
+        shutdown(session->sock, SHUT_RDWR);
+    }
 }
 
-// Handle DOWNLOAD_FILE
-void handle_download_file(client_session_t *session, const char *path) {
+static int download_open(client_session_t *session, const char *path, uint64_t *file_size) {
     char norm_path[MAX_PATH];
     snprintf(norm_path, sizeof(norm_path), "%s", path);
     normalize_path(norm_path);
     
     int fd = open(norm_path, O_RDONLY);
     if (fd < 0) {
-        send_error(session->sock, "Cannot open file");
-        return;
+        send_error(session, "Cannot open file");
+        return -1;
     }
     
     struct stat st;
     if (fstat(fd, &st) != 0) {
         close(fd);
-        send_error(session->sock, "Cannot stat file");
+        send_error(session, "Cannot stat file");
+        return -1;
+    }
+    *file_size = st.st_size;
+    return fd;
+}
+
+// Handle DOWNLOAD_FILE
+// Sends the file size as RESP_DATA, then the raw bytes - or, with
+// FEATURE_LZ4, a sequence of compressed blocks (see download_send_framed).
+void handle_download_file(client_session_t *session, const char *path) {
+    uint64_t file_size;
+    int fd = download_open(session, path, &file_size);
+    if (fd < 0) {
         return;
     }
     
     // Send file size first
-    uint64_t file_size = st.st_size;
-    send_response(session->sock, RESP_DATA, &file_size, sizeof(file_size));
+    send_response(session, RESP_DATA, &file_size, sizeof(file_size));
+    download_send(session, fd, 0, file_size);
+    close(fd);
+}
+
+// Handle DOWNLOAD_RANGE - part of a file, for striped or resumed downloads
+// Payload: path + '\0' + offset(8) + length(8), length 0 = up to the end
+// Reply RESP_DATA: file_size(8) + offset(8) + length(8), then the bytes in
+// the same format as DOWNLOAD_FILE. The length is clamped to the file end.
+void handle_download_range(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    const char *path = (const char *)data;
+    uint32_t path_len = strlen(path);
+    if (path_len + 17 > data_len) {
+        send_error(session, "Invalid range request");
+        return;
+    }
+    uint64_t offset, length;
+    memcpy(&offset, data + path_len + 1, 8);
+    memcpy(&length, data + path_len + 9, 8);
     
-    // Manual read/write loop for maximum sustained throughput
-    // FreeBSD sendfile has TCP congestion issues with large files
-    char *buffer = malloc(8 * 1024 * 1024);
-    if (!buffer) {
+    uint64_t file_size;
+    int fd = download_open(session, path, &file_size);
+    if (fd < 0) {
+        return;
+    }
+    if (offset > file_size) {
         close(fd);
-        send_error(session->sock, "Out of memory");
+        send_error(session, "Offset beyond end of file");
         return;
     }
+    if (length == 0 || length > file_size - offset) {
+        length = file_size - offset;
+    }
     
-    ssize_t n;
-    while ((n = read(fd, buffer, 8 * 1024 * 1024)) > 0) {
-        ssize_t sent = 0;
-        while (sent < n) {
-            ssize_t s = send(session->sock, buffer + sent, n - sent, 0);
-            if (s <= 0) {
-                free(buffer);
-                close(fd);
-                return;
+    uint8_t reply[24];
+    memcpy(reply, &file_size, 8);
+    memcpy(reply + 8, &offset, 8);
+    memcpy(reply + 16, &length, 8);
+    send_response(session, RESP_DATA, reply, sizeof(reply));
+    download_send(session, fd, offset, length);
+    close(fd);
+}
+
+// ============================================================================
+// TREE DOWNLOAD
+// ============================================================================
+// DOWNLOAD_TREE streams a whole directory as one record stream, so a backup
+// of thousands of small files costs one round trip instead of one per file.
+// A producer thread walks the tree iteratively and packs records back to back
+// into the download ring - small files share a buffer, and the next file is
+// read while the previous one is still being sent.
+//
+// Record: type(1) + path_len(2) + mode(4) + mtime(8) + size(8) + path
+//         [+ size bytes of data for TREE_FILE]
+// Paths are relative to the root, '/' separated, without a terminator.
+// The stream ends with a TREE_END record: mode = errors, size = entries.
+// A file that shrinks while being read is padded with zeros and counted as
+// an error; unreadable entries are skipped and counted.
+
+#define TREE_END 0
+#define TREE_DIR 1
+#define TREE_FILE 2
+#define TREE_RECORD_HEADER 23
+
+typedef struct {
+    char root[MAX_PATH];
+    download_slot_t *slot;  // Slot being filled, NULL once the sender gave up
+    uint64_t entries;
+    uint32_t errors;
+} tree_walk_t;
+
+// Room in the current slot, moving on to a fresh slot when it is full
+static uint8_t *tree_space(download_ring_t *ring, tree_walk_t *tw, size_t *avail) {
+    if (!tw->slot) return NULL;
+    if (tw->slot->raw_len == tw->slot->cap) {
+        ring_publish(ring, tw->slot);
+        tw->slot = ring_claim(ring);
+        if (!tw->slot) return NULL;
+    }
+    *avail = tw->slot->cap - tw->slot->raw_len;
+    return tw->slot->in + tw->slot->raw_len;
+}
+
+static int tree_put(download_ring_t *ring, tree_walk_t *tw, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0) {
+        size_t avail;
+        uint8_t *dst = tree_space(ring, tw, &avail);
+        if (!dst) return -1;
+        size_t n = len < avail ? len : avail;
+        memcpy(dst, p, n);
+        tw->slot->raw_len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int tree_put_record(download_ring_t *ring, tree_walk_t *tw, uint8_t type, const char *rel,
+                           uint32_t mode, int64_t mtime, uint64_t size) {
+    uint8_t hdr[TREE_RECORD_HEADER];
+    uint16_t path_len = (uint16_t)strlen(rel);
+    hdr[0] = type;
+    memcpy(hdr + 1, &path_len, 2);
+    memcpy(hdr + 3, &mode, 4);
+    memcpy(hdr + 7, &mtime, 8);
+    memcpy(hdr + 15, &size, 8);
+    if (tree_put(ring, tw, hdr, sizeof(hdr)) != 0) return -1;
+    return tree_put(ring, tw, rel, path_len);
+}
+
+// File data is read straight into the ring, no intermediate copy
+static int tree_put_file(download_ring_t *ring, tree_walk_t *tw, const char *full, const char *rel) {
+    int fd = open(full, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        tw->errors++;
+        return 0;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    uint64_t size = st.st_size;
+    int rc = tree_put_record(ring, tw, TREE_FILE, rel, st.st_mode, st.st_mtime, size);
+    uint64_t offset = 0;
+    bool short_read = false;
+    while (rc == 0 && offset < size) {
+        size_t avail;
+        uint8_t *dst = tree_space(ring, tw, &avail);
+        if (!dst) {
+            rc = -1;
+            break;
+        }
+        size_t want = size - offset < avail ? (size_t)(size - offset) : avail;
+        ssize_t n = short_read ? 0 : pread(fd, dst, want, (off_t)offset);
+        if (n <= 0) {
+            // Shrank under us - the size is already announced, pad it out
+            short_read = true;
+            memset(dst, 0, want);
+            n = (ssize_t)want;
+        }
+        tw->slot->raw_len += n;
+        offset += n;
+    }
+    close(fd);
+    if (short_read) tw->errors++;
+    tw->entries++;
+    return rc;
+}
+
+static void *tree_walker(void *arg) {
+    download_ring_t *ring = (download_ring_t *)arg;
+    tree_walk_t *tw = (tree_walk_t *)ring->ctx;
+    
+    // Directories still to visit, as paths relative to the root
+    int stack_count = 0, stack_cap = 64;
+    char **stack = (char **)malloc(sizeof(char *) * stack_cap);
+    char *first = strdup("");
+    bool failed = !stack || !first;
+    if (!failed) {
+        stack[stack_count++] = first;
+    } else {
+        free(first);
+    }
+    
+    tw->slot = failed ? NULL : ring_claim(ring);
+    char full[MAX_PATH];
+    char rel[MAX_PATH];
+    while (tw->slot && stack_count > 0) {
+        char *dir_rel = stack[--stack_count];
+        int full_len = snprintf(full, sizeof(full), "%s%s%s", tw->root, dir_rel[0] ? "/" : "", dir_rel);
+        DIR *dir = full_len < (int)sizeof(full) ? opendir(full) : NULL;
+        if (!dir) {
+            tw->errors++;
+            free(dir_rel);
+            continue;
+        }
+        
+        struct dirent *entry;
+        while (tw->slot && (entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            int rel_len = snprintf(rel, sizeof(rel), "%s%s%s", dir_rel, dir_rel[0] ? "/" : "", entry->d_name);
+            int full_len = snprintf(full, sizeof(full), "%s/%s", tw->root, rel);
+            struct stat st;
+            if (rel_len >= (int)sizeof(rel) || full_len >= (int)sizeof(full) || lstat(full, &st) != 0) {
+                tw->errors++;
+                continue;
+            }
+            
+            if (S_ISDIR(st.st_mode)) {
+                if (tree_put_record(ring, tw, TREE_DIR, rel, st.st_mode, st.st_mtime, 0) != 0) break;
+                tw->entries++;
+                if (stack_count == stack_cap) {
+                    char **grown = (char **)realloc(stack, sizeof(char *) * stack_cap * 2);
+                    if (!grown) {
+                        tw->errors++;
+                        continue;
+                    }
+                    stack = grown;
+                    stack_cap *= 2;
+                }
+                char *copy = strdup(rel);
+                if (copy) {
+                    stack[stack_count++] = copy;
+                } else {
+                    tw->errors++;
+                }
+            } else if (S_ISREG(st.st_mode)) {
+                if (tree_put_file(ring, tw, full, rel) != 0) break;
             }
-            sent += s;
+            // Symlinks, devices and sockets are not part of a backup
         }
+        closedir(dir);
+        free(dir_rel);
     }
     
-    free(buffer);
+    if (tw->slot && tree_put_record(ring, tw, TREE_END, "", tw->errors, 0, tw->entries) == 0) {
+        ring_publish(ring, tw->slot);
+    } else {
+        failed = true;
+    }
+    while (stack_count > 0) {
+        free(stack[--stack_count]);
+    }
+    free(stack);
+    ring_finish(ring, failed);
+    return NULL;
+}
+
+// Handle DOWNLOAD_TREE
+// Payload: root path + '\0'
+// Reply RESP_READY, then the record stream - raw, or LZ4 framed blocks
+// (as for DOWNLOAD_FILE) when FEATURE_LZ4 is negotiated.
+void handle_download_tree(client_session_t *session, const char *path) {
+    tree_walk_t tw;
+    memset(&tw, 0, sizeof(tw));
+    snprintf(tw.root, sizeof(tw.root), "%s", path);
+    normalize_path(tw.root);
+    size_t root_len = strlen(tw.root);
+    if (root_len > 1 && tw.root[root_len - 1] == '/') {
+        tw.root[root_len - 1] = '\0';
+    }
     
-    close(fd);
+    struct stat st;
+    if (stat(tw.root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        send_error(session, "Not a directory");
+        return;
+    }
+    send_response(session, RESP_READY, NULL, 0);
+    
+    uint64_t start_us = monotonic_us();
+    uint64_t start_cpu = thread_cpu_us();
+    download_ring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    ring.ctx = &tw;
+    uint64_t sent = 0;
+    int rc = download_ring_run(session, &ring, tree_walker, &sent);
+    
+    download_count((session->features & FEATURE_LZ4) ? DOWNLOAD_MODE_FRAMED : DOWNLOAD_MODE_COPY, sent,
+                   monotonic_us() - start_us, thread_cpu_us() - start_cpu + ring.producer_cpu_us);
+    if (rc != 0) {
+        shutdown(session->sock, SHUT_RDWR);
+    }
 }
 
 // Handle SHELL_OPEN - Initialize shell session
@@ -1105,9 +5658,10 @@ void index_clear() {
     pthread_mutex_unlock(&g_index.mutex);
 }
 
-// Recursive filesystem scan
-void index_scan_directory(const char *path) {
-    DIR *dir = opendir(path);
+// Recursive filesystem scan. path is the full path of the directory, kept
+// only for the entries - lookups go through the open directory fd.
+static void index_scan_at(int at, const char *name, const char *path) {
+    DIR *dir = dir_open_at(at, name);
     if (!dir) {
         // Log error but continue
         return;
@@ -1127,8 +5681,10 @@ void index_scan_directory(const char *path) {
             snprintf(fullpath, sizeof(fullpath), "%s/%s", path, entry->d_name);
         }
         
+        // The index records size and mtime of directories too, so every
+        // entry needs its stat
         struct stat st;
-        if (stat(fullpath, &st) == 0) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) {
             bool is_dir = S_ISDIR(st.st_mode);
             index_add_entry(fullpath, entry->d_name, st.st_size, st.st_mtime, is_dir);
             
@@ -1138,7 +5694,7 @@ void index_scan_directory(const char *path) {
                 if (strcmp(entry->d_name, "dev") != 0 &&
                     strcmp(entry->d_name, "proc") != 0 &&
                     strcmp(entry->d_name, "sys") != 0) {
-                    index_scan_directory(fullpath);
+                    index_scan_at(dirfd(dir), entry->d_name, fullpath);
                 }
             }
         }
@@ -1146,6 +5702,10 @@ void index_scan_directory(const char *path) {
     closedir(dir);
 }
 
+void index_scan_directory(const char *path) {
+    index_scan_at(AT_FDCWD, path, path);
+}
+
 // Indexing thread
 void* index_thread_func(void* arg) {
     const char **paths = (const char**)arg;
@@ -1233,7 +5793,7 @@ bool parse_size_filter(const char *filter, int64_t *min_size, int64_t *max_size)
 // Search index with query
 void handle_search_index(client_session_t *session, const char *query) {
     if (!g_index.ready) {
-        send_error(session->sock, "Index not ready. Start indexing first.");
+        send_error(session, "Index not ready. Start indexing first.");
         return;
     }
     
@@ -1286,22 +5846,32 @@ void handle_search_index(client_session_t *session, const char *query) {
             continue;
         }
         
-        // Send result
-        uint8_t resp = RESP_DATA;
-        send(session->sock, &resp, 1, 0);
-        
-        // Send: path_len(4) + path + name_len(4) + name + size(8) + mtime(8) + is_dir(1)
+        // Send result: path_len(4) + path + name_len(4) + name + size(8) + mtime(8) + is_dir(1)
+        uint8_t rec[1 + 4 + MAX_PATH + 4 + 256 + 17];
         uint32_t path_len = strlen(entry->path);
         uint32_t name_len = strlen(entry->name);
+        uint8_t *ptr = rec + 1;
+        memcpy(ptr, &path_len, 4);
+        memcpy(ptr + 4, entry->path, path_len);
+        ptr += 4 + path_len;
+        memcpy(ptr, &name_len, 4);
+        memcpy(ptr + 4, entry->name, name_len);
+        ptr += 4 + name_len;
+        uint64_t size = entry->size;
+        int64_t mtime = entry->mtime;
+        memcpy(ptr, &size, 8);
+        memcpy(ptr + 8, &mtime, 8);
+        ptr[16] = entry->is_dir ? 1 : 0;
+        ptr += 17;
         
-        send(session->sock, &path_len, 4, 0);
-        send(session->sock, entry->path, path_len, 0);
-        send(session->sock, &name_len, 4, 0);
-        send(session->sock, entry->name, name_len, 0);
-        send(session->sock, &entry->size, 8, 0);
-        send(session->sock, &entry->mtime, 8, 0);
-        uint8_t is_dir = entry->is_dir ? 1 : 0;
-        send(session->sock, &is_dir, 1, 0);
+        // Results collect in the output buffer and go out with the final OK
+        if (session->features & FEATURE_MUX) {
+            response_queue(session, RESP_DATA, rec + 1, (uint32_t)(ptr - rec - 1));
+        } else {
+            // Legacy framing: a bare RESP_DATA byte, then the record without a length
+            rec[0] = RESP_DATA;
+            stream_queue(session, rec, (size_t)(ptr - rec));
+        }
         
         result_count++;
         entry = entry->next;
@@ -1311,13 +5881,13 @@ void handle_search_index(client_session_t *session, const char *query) {
     
     char msg[128];
     snprintf(msg, sizeof(msg), "Found %d results", result_count);
-    send_ok(session->sock, msg);
+    send_ok(session, msg);
 }
 
 // Start indexing
 void handle_index_start(client_session_t *session, const char *paths_str) {
     if (g_index.indexing) {
-        send_error(session->sock, "Indexing already in progress");
+        send_error(session, "Indexing already in progress");
         return;
     }
     
@@ -1343,7 +5913,7 @@ void handle_index_start(client_session_t *session, const char *paths_str) {
     
     // Start indexing thread
     if (pthread_create(&g_index.thread, NULL, index_thread_func, paths) != 0) {
-        send_error(session->sock, "Failed to start indexing thread");
+        send_error(session, "Failed to start indexing thread");
         for (int i = 0; i < path_count; i++) {
             free((void*)paths[i]);
         }
@@ -1352,7 +5922,7 @@ void handle_index_start(client_session_t *session, const char *paths_str) {
     }
     
     pthread_detach(g_index.thread);
-    send_ok(session->sock, "Indexing started");
+    send_ok(session, "Indexing started");
 }
 
 // Get index status
@@ -1372,7 +5942,7 @@ void handle_index_status(client_session_t *session) {
     
     pthread_mutex_unlock(&g_index.mutex);
     
-    send_ok(session->sock, status);
+    send_ok(session, status);
 }
 
 // ============================================================================
@@ -1381,7 +5951,7 @@ void handle_index_status(client_session_t *session) {
 
 void handle_shell_open(client_session_t *session) {
     if (session->shell_active) {
-        send_error(session->sock, "Shell already active");
+        send_error(session, "Shell already active");
         return;
     }
     
@@ -1391,7 +5961,7 @@ void handle_shell_open(client_session_t *session) {
     session->shell_pipe = NULL;
     session->shell_pid = 0;
     
-    send_ok(session->sock, "Shell session opened");
+    send_ok(session, "Shell session opened");
 }
 
 // Built-in ls command
@@ -1400,7 +5970,7 @@ void builtin_ls(client_session_t *session, const char *path) {
     
     DIR *dir = opendir(target);
     if (!dir) {
-        send_error(session->sock, "Cannot open directory");
+        send_error(session, "Cannot open directory");
         return;
     }
     
@@ -1412,13 +5982,11 @@ void builtin_ls(client_session_t *session, const char *path) {
         
         uint8_t resp = RESP_DATA;
         uint32_t data_len = strlen(output);
-        send(session->sock, &resp, 1, 0);
-        send(session->sock, &data_len, 4, 0);
-        send(session->sock, output, data_len, 0);
+        response_queue(session, resp, output, data_len);
     }
     
     closedir(dir);
-    send_ok(session->sock, "");
+    send_ok(session, "");
 }
 
 // Built-in pwd command
@@ -1428,11 +5996,9 @@ void builtin_pwd(client_session_t *session) {
     
     uint8_t resp = RESP_DATA;
     uint32_t data_len = strlen(output);
-    send(session->sock, &resp, 1, 0);
-    send(session->sock, &data_len, 4, 0);
-    send(session->sock, output, data_len, 0);
+    response_queue(session, resp, output, data_len);
     
-    send_ok(session->sock, "");
+    send_ok(session, "");
 }
 
 // Built-in cd command
@@ -1450,20 +6016,20 @@ void builtin_cd(client_session_t *session, const char *path) {
     // Check if directory exists
     DIR *dir = opendir(new_path);
     if (!dir) {
-        send_error(session->sock, "Directory not found");
+        send_error(session, "Directory not found");
         return;
     }
     closedir(dir);
     
     // Update current directory
     strcpy(session->shell_cwd, new_path);
-    send_ok(session->sock, "");
+    send_ok(session, "");
 }
 
 // Built-in cat command
 void builtin_cat(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: cat <file>");
+        send_error(session, "Usage: cat <file>");
         return;
     }
     
@@ -1476,7 +6042,7 @@ void builtin_cat(client_session_t *session, const char *path) {
     
     FILE *fp = fopen(full_path, "r");
     if (!fp) {
-        send_error(session->sock, "Cannot open file");
+        send_error(session, "Cannot open file");
         return;
     }
     
@@ -1488,9 +6054,7 @@ void builtin_cat(client_session_t *session, const char *path) {
         if (len > 0) {
             uint8_t resp = RESP_DATA;
             uint32_t data_len = len;
-            send(session->sock, &resp, 1, 0);
-            send(session->sock, &data_len, 4, 0);
-            send(session->sock, buffer, data_len, 0);
+            response_queue(session, resp, buffer, data_len);
             
             total_sent += len;
             if (total_sent > 1024 * 1024) break; // Max 1MB
@@ -1498,13 +6062,13 @@ void builtin_cat(client_session_t *session, const char *path) {
     }
     
     fclose(fp);
-    send_ok(session->sock, "");
+    send_ok(session, "");
 }
 
 // Built-in mkdir command
 void builtin_mkdir(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: mkdir <directory>");
+        send_error(session, "Usage: mkdir <directory>");
         return;
     }
     
@@ -1516,16 +6080,17 @@ void builtin_mkdir(client_session_t *session, const char *path) {
     }
     
     if (mkdir(full_path, 0777) == 0) {
-        send_ok(session->sock, "Directory created");
+        list_cache_invalidate(full_path);
+        send_ok(session, "Directory created");
     } else {
-        send_error(session->sock, "Failed to create directory");
+        send_error(session, "Failed to create directory");
     }
 }
 
 // Built-in rm command
 void builtin_rm(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: rm <file>");
+        send_error(session, "Usage: rm <file>");
         return;
     }
     
@@ -1537,16 +6102,17 @@ void builtin_rm(client_session_t *session, const char *path) {
     }
     
     if (unlink(full_path) == 0) {
-        send_ok(session->sock, "File deleted");
+        list_cache_invalidate(full_path);
+        send_ok(session, "File deleted");
     } else {
-        send_error(session->sock, "Failed to delete file");
+        send_error(session, "Failed to delete file");
     }
 }
 
 // Built-in rmdir command
 void builtin_rmdir(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: rmdir <directory>");
+        send_error(session, "Usage: rmdir <directory>");
         return;
     }
     
@@ -1558,16 +6124,18 @@ void builtin_rmdir(client_session_t *session, const char *path) {
     }
     
     if (rmdir(full_path) == 0) {
-        send_ok(session->sock, "Directory deleted");
+        dir_cache_invalidate(full_path);
+        list_cache_invalidate(full_path);
+        send_ok(session, "Directory deleted");
     } else {
-        send_error(session->sock, "Failed to delete directory");
+        send_error(session, "Failed to delete directory");
     }
 }
 
 // Built-in touch command
 void builtin_touch(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: touch <file>");
+        send_error(session, "Usage: touch <file>");
         return;
     }
     
@@ -1581,9 +6149,10 @@ void builtin_touch(client_session_t *session, const char *path) {
     FILE *fp = fopen(full_path, "a");
     if (fp) {
         fclose(fp);
-        send_ok(session->sock, "File created/updated");
+        list_cache_invalidate(full_path);
+        send_ok(session, "File created/updated");
     } else {
-        send_error(session->sock, "Failed to create file");
+        send_error(session, "Failed to create file");
     }
 }
 
@@ -1596,16 +6165,14 @@ void builtin_echo(client_session_t *session, const char *text) {
     
     uint8_t resp = RESP_DATA;
     uint32_t data_len = strlen(output);
-    send(session->sock, &resp, 1, 0);
-    send(session->sock, &data_len, 4, 0);
-    send(session->sock, output, data_len, 0);
-    send_ok(session->sock, "");
+    response_queue(session, resp, output, data_len);
+    send_ok(session, "");
 }
 
 // Built-in cp command
 void builtin_cp(client_session_t *session, const char *args) {
     if (!args || strlen(args) == 0) {
-        send_error(session->sock, "Usage: cp <source> <destination>");
+        send_error(session, "Usage: cp <source> <destination>");
         return;
     }
     
@@ -1616,7 +6183,7 @@ void builtin_cp(client_session_t *session, const char *args) {
     char *dst = strtok(NULL, " \t\n");
     
     if (!src || !dst) {
-        send_error(session->sock, "Usage: cp <source> <destination>");
+        send_error(session, "Usage: cp <source> <destination>");
         return;
     }
     
@@ -1629,14 +6196,14 @@ void builtin_cp(client_session_t *session, const char *args) {
     
     FILE *src_fp = fopen(src_path, "rb");
     if (!src_fp) {
-        send_error(session->sock, "Cannot open source file");
+        send_error(session, "Cannot open source file");
         return;
     }
     
     FILE *dst_fp = fopen(dst_path, "wb");
     if (!dst_fp) {
         fclose(src_fp);
-        send_error(session->sock, "Cannot create destination file");
+        send_error(session, "Cannot create destination file");
         return;
     }
     
@@ -1648,13 +6215,14 @@ void builtin_cp(client_session_t *session, const char *args) {
     
     fclose(src_fp);
     fclose(dst_fp);
-    send_ok(session->sock, "File copied");
+    list_cache_invalidate(dst_path);
+    send_ok(session, "File copied");
 }
 
 // Built-in mv command
 void builtin_mv(client_session_t *session, const char *args) {
     if (!args || strlen(args) == 0) {
-        send_error(session->sock, "Usage: mv <source> <destination>");
+        send_error(session, "Usage: mv <source> <destination>");
         return;
     }
     
@@ -1665,7 +6233,7 @@ void builtin_mv(client_session_t *session, const char *args) {
     char *dst = strtok(NULL, " \t\n");
     
     if (!src || !dst) {
-        send_error(session->sock, "Usage: mv <source> <destination>");
+        send_error(session, "Usage: mv <source> <destination>");
         return;
     }
     
@@ -1677,16 +6245,19 @@ void builtin_mv(client_session_t *session, const char *args) {
     else snprintf(dst_path, sizeof(dst_path), "%s/%s", session->shell_cwd, dst);
     
     if (rename(src_path, dst_path) == 0) {
-        send_ok(session->sock, "File moved/renamed");
+        dir_cache_invalidate(src_path);
+        list_cache_invalidate(src_path);
+        list_cache_invalidate(dst_path);
+        send_ok(session, "File moved/renamed");
     } else {
-        send_error(session->sock, "Failed to move file");
+        send_error(session, "Failed to move file");
     }
 }
 
 // Built-in stat command
 void builtin_stat(client_session_t *session, const char *path) {
     if (!path || strlen(path) == 0) {
-        send_error(session->sock, "Usage: stat <file>");
+        send_error(session, "Usage: stat <file>");
         return;
     }
     
@@ -1699,7 +6270,7 @@ void builtin_stat(client_session_t *session, const char *path) {
     
     struct stat st;
     if (stat(full_path, &st) != 0) {
-        send_error(session->sock, "Cannot stat file");
+        send_error(session, "Cannot stat file");
         return;
     }
     
@@ -1716,331 +6287,921 @@ void builtin_stat(client_session_t *session, const char *path) {
     
     uint8_t resp = RESP_DATA;
     uint32_t data_len = strlen(output);
-    send(session->sock, &resp, 1, 0);
-    send(session->sock, &data_len, 4, 0);
-    send(session->sock, output, data_len, 0);
-    send_ok(session->sock, "");
+    response_queue(session, resp, output, data_len);
+    send_ok(session, "");
 }
 
 // Built-in chmod command
 void builtin_chmod(client_session_t *session, const char *args) {
     if (!args || strlen(args) == 0) {
-        send_error(session->sock, "Usage: chmod <mode> <file>");
+        send_error(session, "Usage: chmod <mode> <file>");
+        return;
+    }
+    
+    char args_copy[MAX_PATH];
+    strncpy(args_copy, args, sizeof(args_copy) - 1);
+    
+    char *mode_str = strtok(args_copy, " \t");
+    char *path = strtok(NULL, " \t\n");
+    
+    if (!mode_str || !path) {
+        send_error(session, "Usage: chmod <mode> <file>");
+        return;
+    }
+    
+    int mode = strtol(mode_str, NULL, 8);
+    
+    char full_path[MAX_PATH];
+    if (path[0] == '/') {
+        strcpy(full_path, path);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", session->shell_cwd, path);
+    }
+    
+    if (chmod(full_path, mode) == 0) {
+        send_ok(session, "Permissions changed");
+    } else {
+        send_error(session, "Failed to change permissions");
+    }
+}
+
+// Handle SHELL_EXEC - Execute command and stream output
+void handle_shell_exec(client_session_t *session, const char *command) {
+    if (!session->shell_active) {
+        send_error(session, "Shell not active");
+        return;
+    }
+    
+    if (!command || strlen(command) == 0) {
+        send_error(session, "Empty command");
+        return;
+    }
+    
+    // Parse command and arguments
+    char cmd_copy[MAX_PATH];
+    strncpy(cmd_copy, command, sizeof(cmd_copy) - 1);
+    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+    
+    char *cmd = strtok(cmd_copy, " \t\n");
+    char *arg = strtok(NULL, "\n");
+    
+    if (!cmd) {
+        send_error(session, "Empty command");
+        return;
+    }
+    
+    // Handle built-in commands
+    if (strcmp(cmd, "ls") == 0) {
+        builtin_ls(session, arg);
+    } else if (strcmp(cmd, "pwd") == 0) {
+        builtin_pwd(session);
+    } else if (strcmp(cmd, "cd") == 0) {
+        builtin_cd(session, arg);
+    } else if (strcmp(cmd, "cat") == 0) {
+        builtin_cat(session, arg);
+    } else if (strcmp(cmd, "mkdir") == 0) {
+        builtin_mkdir(session, arg);
+    } else if (strcmp(cmd, "rm") == 0) {
+        builtin_rm(session, arg);
+    } else if (strcmp(cmd, "rmdir") == 0) {
+        builtin_rmdir(session, arg);
+    } else if (strcmp(cmd, "touch") == 0) {
+        builtin_touch(session, arg);
+    } else if (strcmp(cmd, "echo") == 0) {
+        builtin_echo(session, arg);
+    } else if (strcmp(cmd, "cp") == 0) {
+        builtin_cp(session, arg);
+    } else if (strcmp(cmd, "mv") == 0) {
+        builtin_mv(session, arg);
+    } else if (strcmp(cmd, "stat") == 0) {
+        builtin_stat(session, arg);
+    } else if (strcmp(cmd, "chmod") == 0) {
+        builtin_chmod(session, arg);
+    } else if (strcmp(cmd, "help") == 0) {
+        const char *help_text = 
+            "PS5 Shell Terminal - Available Commands:\n"
+            "\n"
+            "FILE OPERATIONS:\n"
+            "  ls [path]         - List directory contents\n"
+            "  cat <file>        - Display file contents\n"
+            "  touch <file>      - Create empty file\n"
+            "  rm <file>         - Delete file\n"
+            "  cp <src> <dst>    - Copy file\n"
+            "  mv <src> <dst>    - Move/rename file\n"
+            "  stat <file>       - Show file information\n"
+            "  chmod <mode> <f>  - Change file permissions\n"
+            "\n"
+            "DIRECTORY OPERATIONS:\n"
+            "  pwd               - Print working directory\n"
+            "  cd [path]         - Change directory\n"
+            "  mkdir <dir>       - Create directory\n"
+            "  rmdir <dir>       - Delete empty directory\n"
+            "\n"
+            "UTILITIES:\n"
+            "  echo <text>       - Print text\n"
+            "  help              - Show this help\n"
+            "\n"
+            "TIPS:\n"
+            "  - Use absolute paths (/data/file) or relative (file)\n"
+            "  - Press UP/DOWN arrows for command history\n"
+            "  - Type 'cd' or 'cd ~' to go to /data\n";
+        
+        uint8_t resp = RESP_DATA;
+        uint32_t data_len = strlen(help_text);
+        response_queue(session, resp, help_text, data_len);
+        send_ok(session, "");
+    } else {
+        send_error(session, "Command not found. Type 'help' for available commands.");
+    }
+}
+
+// Handle SHELL_INTERRUPT - Not implemented (would need fork/exec for proper signal handling)
+void handle_shell_interrupt(client_session_t *session) {
+    send_error(session, "Interrupt not supported in this implementation");
+}
+
+// Handle SHELL_CLOSE - Close shell session
+void handle_shell_close(client_session_t *session) {
+    if (!session->shell_active) {
+        send_error(session, "Shell not active");
+        return;
+    }
+    
+    session->shell_active = false;
+    session->shell_pipe = NULL;
+    session->shell_pid = 0;
+    
+    send_ok(session, "Shell session closed");
+}
+
+static size_t conn_format_stats(char *out, size_t out_size);
+
+// Handle STATS - server internals as "key=value" lines
+void handle_stats(client_session_t *session) {
+    char stats[4096];
+    size_t len = pool_format_stats(stats, sizeof(stats));
+    len += codec_format_stats(stats + len, sizeof(stats) - len);
+    len += download_format_stats(stats + len, sizeof(stats) - len);
+    len += link_format_stats(stats + len, sizeof(stats) - len);
+    len += conn_format_stats(stats + len, sizeof(stats) - len);
+    len += admit_format_stats(stats + len, sizeof(stats) - len);
+    list_cache_format_stats(stats + len, sizeof(stats) - len);
+    send_ok(session, stats);
+}
+
+// Handle RATE_LIMIT
+// Payload: rate(8) - bytes per second for this connection's uploads and
+// downloads, 0 lifts the limit
+void handle_rate_limit(client_session_t *session, const uint8_t *data, uint32_t data_len) {
+    if (data_len < 8) {
+        send_error(session, "Invalid rate");
         return;
     }
-    
-    char args_copy[MAX_PATH];
-    strncpy(args_copy, args, sizeof(args_copy) - 1);
-    
-    char *mode_str = strtok(args_copy, " \t");
-    char *path = strtok(NULL, " \t\n");
-    
-    if (!mode_str || !path) {
-        send_error(session->sock, "Usage: chmod <mode> <file>");
-        return;
+    uint64_t rate;
+    memcpy(&rate, data, 8);
+    pthread_mutex_lock(&session->rate.mutex);
+    session->rate.rate = rate;
+    session->rate.last_us = 0;
+    session->rate.tokens = 0;
+    pthread_mutex_unlock(&session->rate.mutex);
+    send_ok(session, rate ? "Rate limit set" : "Rate limit removed");
+}
+
+// Run one command whose payload has been read. Returns true if the handler
+// read raw bytes off the socket and the connection broke part way.
+static bool dispatch_command(client_session_t *session, uint8_t cmd, uint8_t *data, uint32_t data_len) {
+    bool disconnected = false;
+    switch (cmd) {
+        case CMD_PING:
+            handle_ping(session);
+            break;
+        case CMD_HELLO:
+            handle_hello(session, data, data_len);
+            break;
+        // case CMD_LIST_STORAGE:  // REMOVED - No longer show disk space
+        //     handle_list_storage(session);
+        //     break;
+        case CMD_LIST_DIR:
+            if (data) {
+                handle_list_dir(session, (const char *)data);
+            }
+            break;
+        case CMD_LIST_DIR_PAGED:
+            if (data) {
+                handle_list_dir_paged(session, data, data_len);
+            }
+            break;
+        case CMD_CREATE_DIR:
+            if (data) {
+                handle_create_dir(session, (const char *)data);
+            }
+            break;
+        case CMD_DELETE_FILE:
+            if (data) {
+                handle_delete_file(session, (const char *)data);
+            }
+            break;
+        case CMD_DELETE_DIR:
+            if (data) {
+                handle_delete_dir(session, (const char *)data);
+            }
+            break;
+        case CMD_RENAME:
+            if (data) {
+                handle_rename(session, data, data_len);
+            }
+            break;
+        case CMD_COPY_FILE:
+            if (data) {
+                handle_copy_file(session, data, data_len);
+            }
+            break;
+        case CMD_MOVE_FILE:
+            if (data) {
+                handle_move_file(session, data, data_len);
+            }
+            break;
+        case CMD_START_UPLOAD:
+            if (data) {
+                handle_start_upload(session, data, data_len);
+            }
+            break;
+        case CMD_UPLOAD_STREAM:
+            if (data && handle_upload_stream(session, data, data_len) != 0) {
+                disconnected = true;
+            }
+            break;
+        case CMD_UPLOAD_BATCH:
+            if (data && handle_upload_batch(session, data, data_len) != 0) {
+                disconnected = true;
+            }
+            break;
+        case CMD_UPLOAD_QUERY:
+            if (data) {
+                handle_upload_query(session, (const char *)data);
+            }
+            break;
+        case CMD_BLOCK_SIGNATURES:
+            if (data) {
+                handle_block_signatures(session, data, data_len);
+            }
+            break;
+        case CMD_UPLOAD_DELTA:
+            if (data) {
+                handle_upload_delta(session, data, data_len);
+            }
+            break;
+        case CMD_END_UPLOAD:
+            handle_end_upload(session);
+            break;
+        case CMD_DOWNLOAD_FILE:
+            if (data) {
+                handle_download_file(session, (const char *)data);
+            }
+            break;
+        case CMD_DOWNLOAD_RANGE:
+            if (data) {
+                handle_download_range(session, data, data_len);
+            }
+            break;
+        case CMD_DOWNLOAD_TREE:
+            if (data) {
+                handle_download_tree(session, (const char *)data);
+            }
+            break;
+        case CMD_TRANSFER_CREATE:
+            if (data) {
+                handle_transfer_create(session, data, data_len);
+            }
+            break;
+        case CMD_TRANSFER_JOIN:
+            if (data) {
+                handle_transfer_join(session, data, data_len);
+            }
+            break;
+        case CMD_TRANSFER_STATUS:
+            if (data) {
+                handle_transfer_status(session, data, data_len);
+            }
+            break;
+        case CMD_SHELL_OPEN:
+            handle_shell_open(session);
+            break;
+        case CMD_SHELL_EXEC:
+            if (data) {
+                handle_shell_exec(session, (const char *)data);
+            }
+            break;
+        case CMD_SHELL_INTERRUPT:
+            handle_shell_interrupt(session);
+            break;
+        case CMD_SHELL_CLOSE:
+            handle_shell_close(session);
+            break;
+        case CMD_INDEX_START:
+            if (data) {
+                handle_index_start(session, (const char *)data);
+            }
+            break;
+        case CMD_INDEX_STATUS:
+            handle_index_status(session);
+            break;
+        case CMD_SEARCH_INDEX:
+            if (data) {
+                handle_search_index(session, (const char *)data);
+            }
+            break;
+        case CMD_INDEX_CANCEL:
+            send_error(session, "Index cancel not implemented yet");
+            break;
+        case CMD_STATS:
+            handle_stats(session);
+            break;
+        case CMD_RATE_LIMIT:
+            if (data) {
+                handle_rate_limit(session, data, data_len);
+            }
+            break;
+        case CMD_SHUTDOWN:
+            send_ok(session, "Shutting down");
+            pool_release(data);
+            if (session->upload_fd >= 0) {
+                upload_close(session);
+            }
+            upload_pipe_destroy(&session->pipe);
+            close(session->sock);
+            free(session);
+            exit(0);
+        default:
+            send_error(session, "Unknown command");
+            break;
+    }
+    return disconnected;
+}
+
+// With FEATURE_MUX these run on a thread of their own, so a listing or a
+// download can proceed while an upload streams on the same connection.
+// Upload, shell and HELLO commands stay on the connection thread - they
+// share the session's upload/shell state and arrive in order.
+#define MUX_MAX_INFLIGHT 8
+
+static bool command_is_concurrent(uint8_t cmd) {
+    switch (cmd) {
+        case CMD_PING:
+        case CMD_LIST_DIR:
+        case CMD_LIST_DIR_PAGED:
+        case CMD_CREATE_DIR:
+        case CMD_DELETE_FILE:
+        case CMD_DELETE_DIR:
+        case CMD_RENAME:
+        case CMD_COPY_FILE:
+        case CMD_MOVE_FILE:
+        case CMD_DOWNLOAD_FILE:
+        case CMD_DOWNLOAD_RANGE:
+        case CMD_DOWNLOAD_TREE:
+        case CMD_UPLOAD_QUERY:
+        case CMD_BLOCK_SIGNATURES:
+        case CMD_TRANSFER_CREATE:
+        case CMD_TRANSFER_STATUS:
+        case CMD_INDEX_START:
+        case CMD_INDEX_STATUS:
+        case CMD_SEARCH_INDEX:
+        case CMD_STATS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Short requests a user is waiting on. They take the control lane of the
+// connection workers, ahead of bulk transfers.
+static bool command_is_interactive(uint8_t cmd) {
+    switch (cmd) {
+        case CMD_PING:
+        case CMD_HELLO:
+        case CMD_LIST_DIR:
+        case CMD_LIST_DIR_PAGED:
+        case CMD_CREATE_DIR:
+        case CMD_DELETE_FILE:
+        case CMD_RENAME:
+        case CMD_UPLOAD_QUERY:
+        case CMD_TRANSFER_STATUS:
+        case CMD_SHELL_OPEN:
+        case CMD_SHELL_EXEC:
+        case CMD_SHELL_INTERRUPT:
+        case CMD_SHELL_CLOSE:
+        case CMD_INDEX_STATUS:
+        case CMD_STATS:
+        case CMD_RATE_LIMIT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+typedef struct {
+    client_session_t *session;
+    uint8_t cmd;
+    uint32_t req_id;
+    uint8_t *data;  // Pool buffer, released when the request is done
+    uint32_t data_len;
+} mux_request_t;
+
+static void *mux_request_thread(void *arg) {
+    mux_request_t *req = (mux_request_t *)arg;
+    client_session_t *session = req->session;
+    t_req_id = req->req_id;
+    dispatch_command(session, req->cmd, req->data, req->data_len);
+    pool_release(req->data);
+    free(req);
+    
+    pthread_mutex_lock(&session->inflight_lock);
+    session->inflight--;
+    pthread_cond_broadcast(&session->inflight_done);
+    pthread_mutex_unlock(&session->inflight_lock);
+    return NULL;
+}
+
+// Hand a request to its own thread. Returns false if it has to run inline.
+static bool mux_spawn(client_session_t *session, uint8_t cmd, uint8_t *data, uint32_t data_len) {
+    mux_request_t *req = (mux_request_t *)malloc(sizeof(mux_request_t));
+    if (!req) return false;
+    req->session = session;
+    req->cmd = cmd;
+    req->req_id = t_req_id;
+    req->data = data;
+    req->data_len = data_len;
+    
+    pthread_mutex_lock(&session->inflight_lock);
+    while (session->inflight >= MUX_MAX_INFLIGHT) {
+        pthread_cond_wait(&session->inflight_done, &session->inflight_lock);
+    }
+    session->inflight++;
+    pthread_mutex_unlock(&session->inflight_lock);
+    
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thread, &attr, mux_request_thread, req);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        free(req);
+        pthread_mutex_lock(&session->inflight_lock);
+        session->inflight--;
+        pthread_mutex_unlock(&session->inflight_lock);
+        return false;
+    }
+    return true;
+}
+
+// ============================================================================
+// CONNECTION CORE
+// ============================================================================
+// Connections wait on a readiness backend (kqueue on the console, epoll on a
+// Linux host build) serviced by IO_THREAD_COUNT threads, so an idle
+// connection holds no thread. An I/O thread gathers the command header
+// without blocking; once it is complete the connection moves to a
+// connection worker, which runs the command with the blocking handlers and
+// keeps going while further commands are already waiting on the socket.
+// When the socket runs dry the connection is re-armed and the worker picks
+// up the next one. Registration is one-shot, so one thread owns a
+// connection at a time. Disk writes still go through the disk workers.
+//
+// Ready connections wait in one of two lanes. Interactive commands (see
+// command_is_interactive) take the control lane, which workers always serve
+// first and which may use CONN_CONTROL_RESERVE workers beyond
+// CONN_WORKER_MAX; everything else is bulk and never occupies more than
+// CONN_WORKER_MAX workers. Browsing stays responsive while every bulk
+// worker is busy with a transfer.
+
+#define IO_EVENT_BATCH 64
+#define CONN_CONTROL_RESERVE 4
+
+#define CONN_LANE_CONTROL 0
+#define CONN_LANE_BULK 1
+
+typedef struct {
+    client_session_t *head;
+    client_session_t *tail;
+    int queued;
+    uint64_t dispatched;
+    uint64_t wait_total_us;   // Time spent queued
+    uint64_t wait_max_us;
+} conn_lane_t;
+
+static int g_io_fd = -1;
+static pthread_mutex_t g_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_conn_ready = PTHREAD_COND_INITIALIZER;
+static conn_lane_t g_conn_lanes[2];
+static int g_conn_idle = 0;
+static int g_conn_workers = 0;
+static int g_conn_bulk_busy = 0;  // Workers serving the bulk lane
+
+// Watch the connection for its next readable event
+static int io_arm(client_session_t *session) {
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = session;
+    int op = EPOLL_CTL_MOD;
+    if (!session->io_registered) {
+        // Flag it first - the event can fire before epoll_ctl returns
+        session->io_registered = true;
+        op = EPOLL_CTL_ADD;
+    }
+    return epoll_ctl(g_io_fd, op, session->sock, &ev) == 0 ? 0 : -1;
+#else
+    // EV_ADD on a dropped one-shot filter simply adds it back
+    struct kevent ev;
+    EV_SET(&ev, session->sock, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, session);
+    return kevent(g_io_fd, &ev, 1, NULL, 0, NULL) == 0 ? 0 : -1;
+#endif
+}
+
+// Take whatever part of the command header is available without blocking:
+// cmd(1) + data_len(4), or with FEATURE_MUX cmd(1) + req_id(4) + data_len(4).
+// Returns 1 once complete, 0 if the socket ran dry, -1 when the peer is gone.
+static int conn_read_header(client_session_t *session) {
+    size_t header_len = (session->features & FEATURE_MUX) ? 9 : 5;
+    while (session->header_have < header_len) {
+        ssize_t n = recv(session->sock, session->header + session->header_have,
+                         header_len - session->header_have, MSG_DONTWAIT);
+        if (n > 0) {
+            session->header_have += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+    return 1;
+}
+
+static void *conn_worker(void *arg);
+
+// Queue a connection for a worker, starting another worker if every
+// existing one is busy
+static void conn_schedule(client_session_t *session) {
+    // A complete header decides the lane; teardown is bulk work
+    size_t header_len = (session->features & FEATURE_MUX) ? 9 : 5;
+    int lane = CONN_LANE_BULK;
+    if (!session->closing && session->header_have == header_len &&
+        command_is_interactive(session->header[0])) {
+        lane = CONN_LANE_CONTROL;
     }
     
-    int mode = strtol(mode_str, NULL, 8);
-    
-    char full_path[MAX_PATH];
-    if (path[0] == '/') {
-        strcpy(full_path, path);
+    pthread_mutex_lock(&g_conn_lock);
+    conn_lane_t *l = &g_conn_lanes[lane];
+    session->next_ready = NULL;
+    session->queued_us = monotonic_us();
+    if (l->tail) {
+        l->tail->next_ready = session;
     } else {
-        snprintf(full_path, sizeof(full_path), "%s/%s", session->shell_cwd, path);
+        l->head = session;
+    }
+    l->tail = session;
+    l->queued++;
+    int queued = g_conn_lanes[CONN_LANE_CONTROL].queued + g_conn_lanes[CONN_LANE_BULK].queued;
+    int limit = lane == CONN_LANE_CONTROL ? CONN_WORKER_MAX + CONN_CONTROL_RESERVE : CONN_WORKER_MAX;
+    bool spawn = queued > g_conn_idle && g_conn_workers < limit;
+    if (spawn) {
+        g_conn_workers++;
     }
+    pthread_cond_broadcast(&g_conn_ready);
+    pthread_mutex_unlock(&g_conn_lock);
     
-    if (chmod(full_path, mode) == 0) {
-        send_ok(session->sock, "Permissions changed");
-    } else {
-        send_error(session->sock, "Failed to change permissions");
+    if (spawn) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, conn_worker, NULL) != 0) {
+            // Existing workers get to it
+            pthread_mutex_lock(&g_conn_lock);
+            g_conn_workers--;
+            pthread_mutex_unlock(&g_conn_lock);
+        }
+        pthread_attr_destroy(&attr);
     }
 }
 
-// Handle SHELL_EXEC - Execute command and stream output
-void handle_shell_exec(client_session_t *session, const char *command) {
-    if (!session->shell_active) {
-        send_error(session->sock, "Shell not active");
-        return;
+// Run one command whose header is in session->header.
+// Returns nonzero when the connection has to be closed.
+static int conn_command(client_session_t *session) {
+    uint8_t cmd = session->header[0];
+    uint32_t data_len;
+    bool mux = session->header_have == 9;
+    if (mux) {
+        memcpy(&t_req_id, session->header + 1, 4);
+        memcpy(&data_len, session->header + 5, 4);
+    } else {
+        t_req_id = 0;
+        memcpy(&data_len, session->header + 1, 4);
     }
+    session->header_have = 0;
     
-    if (!command || strlen(command) == 0) {
-        send_error(session->sock, "Empty command");
-        return;
+    // Chunk payloads stream straight from the socket into write buffers
+    if (cmd == CMD_UPLOAD_CHUNK) {
+        return handle_upload_chunk(session, data_len);
+    }
+    if (cmd == CMD_UPLOAD_CHUNK_AT) {
+        return handle_upload_chunk_at(session, data_len);
+    }
+    if (cmd == CMD_UPLOAD_CHUNK_Z) {
+        return handle_upload_chunk_z(session, data_len);
     }
     
-    // Parse command and arguments
-    char cmd_copy[MAX_PATH];
-    strncpy(cmd_copy, command, sizeof(cmd_copy) - 1);
-    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
-    
-    char *cmd = strtok(cmd_copy, " \t\n");
-    char *arg = strtok(NULL, "\n");
+    // Read data if present
+    uint8_t *data = NULL;
+    if (data_len > 0) {
+        if (data_len > BUFFER_SIZE) {
+            send_error(session, "Data too large");
+            return -1;
+        }
+        data = pool_acquire(data_len, data_len, NULL);
+        if (!data) {
+            send_error(session, "Out of memory");
+            return -1;
+        }
+        if (recv_full(session->sock, data, data_len) != 0) {
+            pool_release(data);
+            return -1;
+        }
+    }
     
-    if (!cmd) {
-        send_error(session->sock, "Empty command");
-        return;
+    if (mux && command_is_concurrent(cmd) && mux_spawn(session, cmd, data, data_len)) {
+        return 0;  // The request thread owns data now
+    }
+    // Set by handlers that read raw bytes off the socket
+    bool disconnected = dispatch_command(session, cmd, data, data_len);
+    pool_release(data);
+    return disconnected ? -1 : 0;
+}
+
+static void conn_close(client_session_t *session) {
+    // Requests still running on their own threads use the session - make
+    // their sends fail fast, then wait for them
+    shutdown(session->sock, SHUT_RDWR);
+    pthread_mutex_lock(&session->inflight_lock);
+    while (session->inflight > 0) {
+        pthread_cond_wait(&session->inflight_done, &session->inflight_lock);
     }
+    pthread_mutex_unlock(&session->inflight_lock);
     
-    // Handle built-in commands
-    if (strcmp(cmd, "ls") == 0) {
-        builtin_ls(session, arg);
-    } else if (strcmp(cmd, "pwd") == 0) {
-        builtin_pwd(session);
-    } else if (strcmp(cmd, "cd") == 0) {
-        builtin_cd(session, arg);
-    } else if (strcmp(cmd, "cat") == 0) {
-        builtin_cat(session, arg);
-    } else if (strcmp(cmd, "mkdir") == 0) {
-        builtin_mkdir(session, arg);
-    } else if (strcmp(cmd, "rm") == 0) {
-        builtin_rm(session, arg);
-    } else if (strcmp(cmd, "rmdir") == 0) {
-        builtin_rmdir(session, arg);
-    } else if (strcmp(cmd, "touch") == 0) {
-        builtin_touch(session, arg);
-    } else if (strcmp(cmd, "echo") == 0) {
-        builtin_echo(session, arg);
-    } else if (strcmp(cmd, "cp") == 0) {
-        builtin_cp(session, arg);
-    } else if (strcmp(cmd, "mv") == 0) {
-        builtin_mv(session, arg);
-    } else if (strcmp(cmd, "stat") == 0) {
-        builtin_stat(session, arg);
-    } else if (strcmp(cmd, "chmod") == 0) {
-        builtin_chmod(session, arg);
-    } else if (strcmp(cmd, "help") == 0) {
-        const char *help_text = 
-            "PS5 Shell Terminal - Available Commands:\n"
-            "\n"
-            "FILE OPERATIONS:\n"
-            "  ls [path]         - List directory contents\n"
-            "  cat <file>        - Display file contents\n"
-            "  touch <file>      - Create empty file\n"
-            "  rm <file>         - Delete file\n"
-            "  cp <src> <dst>    - Copy file\n"
-            "  mv <src> <dst>    - Move/rename file\n"
-            "  stat <file>       - Show file information\n"
-            "  chmod <mode> <f>  - Change file permissions\n"
-            "\n"
-            "DIRECTORY OPERATIONS:\n"
-            "  pwd               - Print working directory\n"
-            "  cd [path]         - Change directory\n"
-            "  mkdir <dir>       - Create directory\n"
-            "  rmdir <dir>       - Delete empty directory\n"
-            "\n"
-            "UTILITIES:\n"
-            "  echo <text>       - Print text\n"
-            "  help              - Show this help\n"
-            "\n"
-            "TIPS:\n"
-            "  - Use absolute paths (/data/file) or relative (file)\n"
-            "  - Press UP/DOWN arrows for command history\n"
-            "  - Type 'cd' or 'cd ~' to go to /data\n";
-        
-        uint8_t resp = RESP_DATA;
-        uint32_t data_len = strlen(help_text);
-        send(session->sock, &resp, 1, 0);
-        send(session->sock, &data_len, 4, 0);
-        send(session->sock, help_text, data_len, 0);
-        send_ok(session->sock, "");
-    } else {
-        send_error(session->sock, "Command not found. Type 'help' for available commands.");
+    admit_cancel(session);
+    // Drains in-flight writes and checkpoints the resume journal before closing
+    if (session->upload_fd >= 0) {
+        upload_close(session);
     }
+    upload_pipe_destroy(&session->pipe);
+    pthread_mutex_destroy(&session->send_lock);
+    pthread_mutex_destroy(&session->tune_lock);
+    pthread_mutex_destroy(&session->inflight_lock);
+    pthread_cond_destroy(&session->inflight_done);
+    pthread_mutex_destroy(&session->rate.mutex);
+    close(session->sock);  // Also drops it from the readiness backend
+    free(session);
 }
 
-// Handle SHELL_INTERRUPT - Not implemented (would need fork/exec for proper signal handling)
-void handle_shell_interrupt(client_session_t *session) {
-    send_error(session->sock, "Interrupt not supported in this implementation");
+// A queued upload got its slot: run the request again. Returns nonzero when
+// the connection has to be closed.
+static int conn_resume_upload(client_session_t *session) {
+    admit_waiter_t *w = session->admit_wait;
+    session->admit_wait = NULL;
+    bool disconnected = admit_client_gone(session->sock);
+    bool unclaimed = w->held;
+    if (!disconnected) {
+        session->admit_granted = w->held;
+        t_req_id = w->req_id;
+        disconnected = dispatch_command(session, w->cmd, w->data, w->data_len);
+        unclaimed = session->admit_granted;  // The request failed before taking it
+        session->admit_granted = false;
+    }
+    if (unclaimed) {
+        admit_release(w->path);
+    }
+    admit_waiter_free(w);
+    return disconnected ? -1 : 0;
 }
 
-// Handle SHELL_CLOSE - Close shell session
-void handle_shell_close(client_session_t *session) {
-    if (!session->shell_active) {
-        send_error(session->sock, "Shell not active");
-        return;
+// Serve a connection until its socket runs dry, then hand it back to the
+// readiness backend. A control-lane worker only runs interactive commands -
+// anything else goes back to the bulk lane. A connection whose upload
+// queued for a slot is handed to nobody: admission control schedules it
+// again when the slot is free.
+static void conn_run(client_session_t *session, int lane) {
+    while (!session->closing) {
+        if (session->admit_wait) {
+            if (admit_park(session)) {
+                return;
+            }
+            if (conn_resume_upload(session) != 0) {
+                break;
+            }
+            continue;
+        }
+        int rc = conn_read_header(session);
+        if (rc == 0) {
+            if (io_arm(session) == 0) {
+                return;  // An I/O thread owns it again
+            }
+            break;
+        }
+        if (rc > 0 && lane == CONN_LANE_CONTROL && !command_is_interactive(session->header[0])) {
+            conn_schedule(session);
+            return;
+        }
+        if (rc < 0 || conn_command(session) != 0) {
+            break;
+        }
     }
-    
-    session->shell_active = false;
-    session->shell_pipe = NULL;
-    session->shell_pid = 0;
-    
-    send_ok(session->sock, "Shell session closed");
+    conn_close(session);
 }
 
-// Handle client
-void *client_thread(void *arg) {
-    client_session_t *session = (client_session_t *)arg;
-    uint8_t *buffer = malloc(BUFFER_SIZE);
-    
-    if (!buffer) {
-        close(session->sock);
-        free(session);
-        return NULL;
+// Next lane this worker may take from (caller holds g_conn_lock), -1 if none
+static int conn_pick_lane(void) {
+    if (g_conn_lanes[CONN_LANE_CONTROL].head) {
+        return CONN_LANE_CONTROL;
     }
-    
-    // Initialize upload_fd to -1 (not open)
-    session->upload_fd = -1;
-    
-    // No socket timeout - connection stays open indefinitely until client disconnects
-    
+    if (g_conn_lanes[CONN_LANE_BULK].head && g_conn_bulk_busy < CONN_WORKER_MAX) {
+        return CONN_LANE_BULK;
+    }
+    return -1;
+}
+
+static void *conn_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_conn_lock);
     while (1) {
-        // Read command header (5 bytes: 1 cmd + 4 data_len)
-        uint8_t header[5];
-        ssize_t n = recv(session->sock, header, 5, MSG_WAITALL);
-        if (n != 5) {
-            break;
+        int lane;
+        while ((lane = conn_pick_lane()) < 0) {
+            g_conn_idle++;
+            pthread_cond_wait(&g_conn_ready, &g_conn_lock);
+            g_conn_idle--;
+        }
+        conn_lane_t *l = &g_conn_lanes[lane];
+        client_session_t *session = l->head;
+        l->head = session->next_ready;
+        if (!l->head) {
+            l->tail = NULL;
+        }
+        l->queued--;
+        uint64_t waited = monotonic_us() - session->queued_us;
+        l->dispatched++;
+        l->wait_total_us += waited;
+        if (waited > l->wait_max_us) {
+            l->wait_max_us = waited;
+        }
+        if (lane == CONN_LANE_BULK) {
+            g_conn_bulk_busy++;
         }
+        pthread_mutex_unlock(&g_conn_lock);
         
-        uint8_t cmd = header[0];
-        uint32_t data_len;
-        memcpy(&data_len, header + 1, 4);
+        conn_run(session, lane);
         
-        // Read data if present
-        uint8_t *data = NULL;
-        if (data_len > 0) {
-            if (data_len > BUFFER_SIZE) {
-                send_error(session->sock, "Data too large");
-                break;
-            }
-            data = buffer;
-            ssize_t received = 0;
-            while (received < data_len) {
-                n = recv(session->sock, data + received, data_len - received, 0);
-                if (n <= 0) {
-                    break;
-                }
-                received += n;
-            }
-            if (received != data_len) {
-                break;
+        pthread_mutex_lock(&g_conn_lock);
+        if (lane == CONN_LANE_BULK) {
+            g_conn_bulk_busy--;
+            pthread_cond_broadcast(&g_conn_ready);  // Bulk work may be waiting for the slot
+        }
+    }
+    return NULL;
+}
+
+// Append lane counters to a STATS reply. Returns the length written.
+static size_t conn_format_stats(char *out, size_t out_size) {
+    static const char *names[2] = {"sched_control", "sched_bulk"};
+    size_t len = 0;
+    pthread_mutex_lock(&g_conn_lock);
+    for (int lane = CONN_LANE_CONTROL; lane <= CONN_LANE_BULK && len < out_size; lane++) {
+        conn_lane_t *l = &g_conn_lanes[lane];
+        len += snprintf(out + len, out_size - len,
+                        "%s=dispatched:%llu queued:%d wait_us_avg:%llu wait_us_max:%llu\n",
+                        names[lane], (unsigned long long)l->dispatched, l->queued,
+                        (unsigned long long)(l->dispatched ? l->wait_total_us / l->dispatched : 0),
+                        (unsigned long long)l->wait_max_us);
+    }
+    if (len < out_size) {
+        len += snprintf(out + len, out_size - len, "sched_workers=%d bulk_busy:%d idle:%d\n",
+                        g_conn_workers, g_conn_bulk_busy, g_conn_idle);
+    }
+    pthread_mutex_unlock(&g_conn_lock);
+    return len < out_size ? len : out_size - 1;
+}
+
+// A watched connection became readable: collect the header here and only
+// involve a worker once there is a command to run
+static void conn_readable(client_session_t *session) {
+    int rc = conn_read_header(session);
+    if (rc == 0 && io_arm(session) == 0) {
+        return;
+    }
+    if (rc != 1) {
+        session->closing = true;  // Teardown may block, leave it to a worker
+    }
+    conn_schedule(session);
+}
+
+static void *io_thread(void *arg) {
+    (void)arg;
+#ifdef __linux__
+    struct epoll_event events[IO_EVENT_BATCH];
+#else
+    struct kevent events[IO_EVENT_BATCH];
+#endif
+    while (1) {
+#ifdef __linux__
+        int n = epoll_wait(g_io_fd, events, IO_EVENT_BATCH, -1);
+#else
+        int n = kevent(g_io_fd, NULL, 0, events, IO_EVENT_BATCH, NULL);
+#endif
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            break;
         }
-        
-        // Handle command
-        switch (cmd) {
-            case CMD_PING:
-                handle_ping(session);
-                break;
-            // case CMD_LIST_STORAGE:  // REMOVED - No longer show disk space
-            //     handle_list_storage(session);
-            //     break;
-            case CMD_LIST_DIR:
-                if (data) {
-                    handle_list_dir(session, (const char *)data);
-                }
-                break;
-            case CMD_CREATE_DIR:
-                if (data) {
-                    handle_create_dir(session, (const char *)data);
-                }
-                break;
-            case CMD_DELETE_FILE:
-                if (data) {
-                    handle_delete_file(session, (const char *)data);
-                }
-                break;
-            case CMD_DELETE_DIR:
-                if (data) {
-                    handle_delete_dir(session, (const char *)data);
-                }
-                break;
-            case CMD_RENAME:
-                if (data) {
-                    handle_rename(session, data, data_len);
-                }
-                break;
-            case CMD_COPY_FILE:
-                if (data) {
-                    handle_copy_file(session, data, data_len);
-                }
-                break;
-            case CMD_MOVE_FILE:
-                if (data) {
-                    handle_move_file(session, data, data_len);
-                }
-                break;
-            case CMD_START_UPLOAD:
-                if (data) {
-                    handle_start_upload(session, data, data_len);
-                }
-                break;
-            case CMD_UPLOAD_CHUNK:
-                if (data) {
-                    handle_upload_chunk(session, data, data_len);
-                }
-                break;
-            case CMD_END_UPLOAD:
-                handle_end_upload(session);
-                break;
-            case CMD_DOWNLOAD_FILE:
-                if (data) {
-                    handle_download_file(session, (const char *)data);
-                }
-                break;
-            case CMD_SHELL_OPEN:
-                handle_shell_open(session);
-                break;
-            case CMD_SHELL_EXEC:
-                if (data) {
-                    handle_shell_exec(session, (const char *)data);
-                }
-                break;
-            case CMD_SHELL_INTERRUPT:
-                handle_shell_interrupt(session);
-                break;
-            case CMD_SHELL_CLOSE:
-                handle_shell_close(session);
-                break;
-            case CMD_INDEX_START:
-                if (data) {
-                    handle_index_start(session, (const char *)data);
-                }
-                break;
-            case CMD_INDEX_STATUS:
-                handle_index_status(session);
-                break;
-            case CMD_SEARCH_INDEX:
-                if (data) {
-                    handle_search_index(session, (const char *)data);
-                }
-                break;
-            case CMD_INDEX_CANCEL:
-                send_error(session->sock, "Index cancel not implemented yet");
-                break;
-            case CMD_SHUTDOWN:
-                send_ok(session->sock, "Shutting down");
-                free(buffer);
-                close(session->sock);
-                if (session->upload_fd >= 0) {
-                    close(session->upload_fd);
-                    if (session->file_mutex) {
-                        release_file_mutex(session->upload_path);
-                    }
-                }
-                free(session);
-                exit(0);
-            default:
-                send_error(session->sock, "Unknown command");
-                break;
+        for (int i = 0; i < n; i++) {
+#ifdef __linux__
+            conn_readable((client_session_t *)events[i].data.ptr);
+#else
+            conn_readable((client_session_t *)events[i].udata);
+#endif
         }
     }
-    
-    free(buffer);
-    close(session->sock);
-    if (session->upload_fd >= 0) {
-        close(session->upload_fd);
-        if (session->file_mutex) {
-            release_file_mutex(session->upload_path);
+    return NULL;
+}
+
+static int conn_core_init(void) {
+#ifdef __linux__
+    g_io_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    g_io_fd = kqueue();
+#endif
+    if (g_io_fd < 0) {
+        return -1;
+    }
+    for (int i = 0; i < IO_THREAD_COUNT; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, io_thread, NULL) != 0) {
+            return -1;
         }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+// Take ownership of an accepted socket
+static void conn_open(int sock) {
+    client_session_t *session = malloc(sizeof(client_session_t));
+    if (!session) {
+        close(sock);
+        return;
+    }
+    
+    memset(session, 0, sizeof(client_session_t));
+    session->sock = sock;
+    // No per-connection buffer - payloads borrow from the shared pool
+    upload_pipe_init(&session->pipe);
+    pthread_mutex_init(&session->send_lock, NULL);
+    pthread_mutex_init(&session->tune_lock, NULL);
+    pthread_mutex_init(&session->inflight_lock, NULL);
+    pthread_cond_init(&session->inflight_done, NULL);
+    pthread_mutex_init(&session->rate.mutex, NULL);
+    
+    // Initialize upload_fd to -1 (not open)
+    session->upload_fd = -1;
+    session->basis_fd = -1;
+    link_init(session);
+    
+    if (io_arm(session) != 0) {
+        session->closing = true;
+        conn_schedule(session);
     }
-    free(session);
-    return NULL;
 }
 
 int main() {
+    // Preallocate the shared I/O buffer pool
+    crc32c_init();
+    pool_init();
+    
     // Initialize worker threads for async disk I/O
     init_workers();
     
+    // Helpers for stat-heavy directory listings
+    stat_pool_init();
+    
+    // Readiness backend and the threads that watch client sockets
+    if (conn_core_init() != 0) {
+        return 1;
+    }
+    
     // Initialize index system
     pthread_mutex_init(&g_index.mutex, NULL);
     g_index.entries = NULL;
@@ -2064,8 +7225,9 @@ int main() {
     int no_sigpipe = 1;
     setsockopt(server_sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
     
-    // 16MB buffers for maximum throughput
-    int buf_size = 16 * 1024 * 1024;
+    // Accepted sockets inherit these, and the window scale negotiated in the
+    // handshake has to leave room for link tuning to grow them to LINK_BUF_MAX
+    int buf_size = LINK_BUF_MAX;
     setsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
     setsockopt(server_sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
     
@@ -2118,19 +7280,12 @@ int main() {
         // Aggressive TCP socket options for sustained high speed
         setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
         
-        // Increase buffers to 16MB for maximum throughput
-        int large_buf = 16 * 1024 * 1024;
-        setsockopt(client_sock, SOL_SOCKET, SO_RCVBUF, &large_buf, sizeof(large_buf));
-        setsockopt(client_sock, SOL_SOCKET, SO_SNDBUF, &large_buf, sizeof(large_buf));
+        // Buffer sizes and MSS are set per link by conn_open (see LINK TUNING)
         
         // TCP optimizations - TCP_NODELAY for immediate send
         int nodelay = 1;
         setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         
-        // TCP_MAXSEG to prevent fragmentation and maintain high speed
-        int maxseg = 1460; // Standard Ethernet MSS
-        setsockopt(client_sock, IPPROTO_TCP, TCP_MAXSEG, &maxseg, sizeof(maxseg));
-        
         // NOTE: Removed TCP_NOPUSH - it was causing buffering delays!
         
         // CRITICAL: Unlimited timeout for files of ANY size
@@ -2154,26 +7309,7 @@ int main() {
         setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl));
         setsockopt(client_sock, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt));
         
-        client_session_t *session = malloc(sizeof(client_session_t));
-        if (!session) {
-            close(client_sock);
-            continue;
-        }
-        
-        memset(session, 0, sizeof(client_session_t));
-        session->sock = client_sock;
-        
-        pthread_t thread;
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        
-        if (pthread_create(&thread, &attr, client_thread, session) != 0) {
-            close(client_sock);
-            free(session);
-        }
-        
-        pthread_attr_destroy(&attr);
+        conn_open(client_sock);
     }
     
     close(server_sock);